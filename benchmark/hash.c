@@ -0,0 +1,110 @@
+// Compares the string hash with byte-wise FNV-1a: throughput at several string lengths, and the mean linear-probe length
+// when inserting keys into a power-of-two table, as vm.strings does.
+// Usage: hash_benchmark
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/object.h"
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+/// @brief The FNV-1a hash that strings used before.
+static uint32_t hashFnv(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; ++i) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/// @returns Monotonic time in seconds.
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/// @brief Hashes strings of the given length at varying offsets into a buffer and prints the time per hash.
+static void measureThroughput(const char* name, HashFn hash, int length, long iterations) {
+    int size = length + 1024;
+    char* buffer = (char*)malloc(size);
+    if (buffer == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i < size; ++i) {
+        buffer[i] = (char)('a' + (i * 7) % 26);
+    }
+
+    // Summed and checked so that the calls aren't optimized out.
+    uint32_t sum = 0;
+    double start = now();
+    for (long i = 0; i < iterations; ++i) {
+        sum += hash(buffer + (i & 1023), length);
+    }
+    double elapsed = now() - start;
+    if (sum == 1) {
+        printf("\n");
+    }
+
+    printf("%-6s len %6d: %10.2f ns/hash %6.2f GB/s\n", name, length, elapsed / iterations * 1e9,
+           (double)length * iterations / elapsed / 1e9);
+    free(buffer);
+}
+
+/// @brief Inserts generated keys into a linearly probed table at most 3/4 full and prints the probe lengths.
+static void measureProbes(const char* name, HashFn hash, int keyCount, const char* format) {
+    int capacity = 1;
+    while (capacity * 3 < keyCount * 4) {
+        capacity <<= 1;
+    }
+    bool* occupied = (bool*)calloc(capacity, sizeof(bool));
+    if (occupied == NULL) {
+        exit(1);
+    }
+
+    long totalProbes = 0;
+    int maxProbes = 0;
+    char key[64];
+    for (int i = 0; i < keyCount; ++i) {
+        int length = snprintf(key, sizeof(key), format, i);
+        uint32_t index = hash(key, length) & (capacity - 1);
+        int probes = 0;
+        while (occupied[index]) {
+            index = (index + 1) & (capacity - 1);
+            ++probes;
+        }
+        occupied[index] = true;
+        totalProbes += probes;
+        if (probes > maxProbes) {
+            maxProbes = probes;
+        }
+    }
+
+    printf("%-6s %6d keys like \"%s\": mean probe %.2f, max %d\n", name, keyCount, format, (double)totalProbes / keyCount,
+           maxProbes);
+    free(occupied);
+}
+
+int main() {
+    const int lengths[] = {3, 8, 16, 32, 100, 1000, 100000};
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); ++i) {
+        long iterations = 200000000L / (lengths[i] + 20);
+        measureThroughput("fnv", hashFnv, lengths[i], iterations);
+        measureThroughput("string", hashString, lengths[i], iterations);
+    }
+
+    const int keyCounts[] = {500, 5000, 50000};
+    const char* formats[] = {"var%d", "item_%08d_x"};
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            measureProbes("fnv", hashFnv, keyCounts[j], formats[i]);
+            measureProbes("string", hashString, keyCounts[j], formats[i]);
+        }
+    }
+    return 0;
+}
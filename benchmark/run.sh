@@ -0,0 +1,25 @@
+#!/bin/bash
+# Runs every benchmark/*.lox script with the given interpreter and prints the best wall time of several runs.
+# Usage: benchmark/run.sh path/to/clox [runs] [pattern]
+
+clox="$1"
+runs="${2:-5}"
+pattern="${3:-*}"
+if [ -z "$clox" ]; then
+    echo "Usage: $0 path/to/clox [runs] [pattern]" >&2
+    exit 64
+fi
+dir=$(dirname "$0")
+
+for benchmark in "$dir"/$pattern.lox; do
+    best=""
+    for ((run = 0; run < runs; ++run)); do
+        start=$(date +%s%N)
+        "$clox" "$benchmark" > /dev/null || exit 1
+        elapsed=$((($(date +%s%N) - start) / 1000000))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+    done
+    printf '%-24s %6d ms\n' "$(basename "$benchmark" .lox)" "$best"
+done
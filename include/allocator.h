@@ -0,0 +1,109 @@
+#ifndef CLOX_INCLUDE_ALLOCATOR_H
+#define CLOX_INCLUDE_ALLOCATOR_H
+
+#include "common.h"
+#include "value.h"
+
+/// @brief Size of an allocator page. Pages are aligned to their size, so an object's page can be found by masking its address.
+#define PAGE_SIZE (16 * 1024)
+/// @brief Granularity of the small size classes. Every object is aligned to this.
+#define SIZE_CLASS_GRANULE 8
+/// @brief Number of small size classes, one granule apart.
+#define SMALL_SIZE_CLASS_COUNT 32
+/// @brief Number of medium size classes above the small ones, four per doubling of the size.
+#define MEDIUM_SIZE_CLASS_COUNT 16
+/// @brief Number of size classes; objects larger than the last one get a page of their own.
+#define SIZE_CLASS_COUNT (SMALL_SIZE_CLASS_COUNT + MEDIUM_SIZE_CLASS_COUNT)
+/// @brief Largest object size that is served from a size class.
+#define SMALL_OBJECT_MAX (PAGE_SIZE / 4)
+/// @brief Number of 64-bit words in a page's slot bitmaps.
+#define PAGE_BITMAP_WORDS ((PAGE_SIZE / SIZE_CLASS_GRANULE + 63) / 64)
+
+/// @returns The page that holds the given object.
+#define PAGE_OF(object) ((Page*)((uintptr_t)(object) & ~(uintptr_t)(PAGE_SIZE - 1)))
+/// @returns The index of an object's mark bit, one bit per granule of its page.
+#define MARK_INDEX(object) ((int)(((uintptr_t)(object) & (PAGE_SIZE - 1)) / SIZE_CLASS_GRANULE))
+
+/// @brief A page of equally sized object slots, or a single large object.
+typedef struct Page {
+    struct Page* next;
+    // Index of the page's size class, or -1 for a large-object page.
+    int sizeClass;
+    int slotCount;
+    size_t slotSize;
+    // Slots below this index have been handed out at least once; the rest are untouched.
+    int bumpIndex;
+    int liveCount;
+    // Slots that were freed by a sweep, threaded through their first word.
+    void* freeList;
+    uint64_t allocBits[PAGE_BITMAP_WORDS];
+    // GC mark bits, kept outside the page so that marking never writes to the objects' memory.
+    uint64_t* markBits;
+    // Set while compaction moves the page's objects out. Their old slots then hold forwarding addresses.
+    bool evacuating;
+} Page;
+
+typedef struct {
+    Page* pages;
+    Page* tail;
+    // The page that allocation is currently served from.
+    Page* current;
+} SizeClass;
+
+typedef struct {
+    SizeClass classes[SIZE_CLASS_COUNT];
+    Page* largePages;
+    int pageCount;
+} Heap;
+
+/// @brief Called on every object that the heap is about to free.
+typedef void (*FinalizeFn)(Obj* object);
+/// @brief Called on every object during a heap walk.
+typedef void (*VisitFn)(Obj* object);
+
+/// @brief Initializes an empty heap.
+void initHeap(Heap* heap);
+/// @brief Finalizes every object in the heap and returns all of its pages to the system.
+void freeHeap(Heap* heap, FinalizeFn finalize);
+
+/// @returns The number of bytes an allocation of the given size actually occupies.
+size_t heapAllocationSize(size_t size);
+/// @brief Allocates uninitialized memory for an object from the matching size class.
+void* heapAllocate(Heap* heap, size_t size);
+/// @returns Whether the given object has been GC-marked.
+static inline bool isMarked(Obj* object) {
+    int index = MARK_INDEX(object);
+    return (PAGE_OF(object)->markBits[index / 64] >> (index % 64)) & 1;
+}
+/// @brief Sets the given object's GC mark bit.
+static inline void setMarked(Obj* object) {
+    int index = MARK_INDEX(object);
+    PAGE_OF(object)->markBits[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+/// @brief Frees every allocated object that isn't GC-marked and clears the marks of the survivors.
+/// @returns The number of bytes freed.
+size_t sweepHeap(Heap* heap, FinalizeFn finalize);
+
+/// @returns The number of size-class pages that hold objects, leaving out empty and large-object pages.
+int heapOccupiedPageCount(Heap* heap);
+/// @returns The fraction of unused slots in the size-class pages that hold objects.
+double heapFragmentation(Heap* heap);
+/// @brief Moves every object out of the size-class pages that are less occupied than the given fraction, packing them into the
+/// remaining pages. Each moved object's old slot is left holding its new address.
+/// @returns The number of objects moved.
+int evacuateHeap(Heap* heap, double occupancyThreshold);
+/// @brief Calls visit on every object, skipping the old copies in pages being evacuated.
+void walkHeap(Heap* heap, VisitFn visit);
+/// @brief Returns the pages emptied by evacuateHeap() to the system.
+void releaseEvacuatedPages(Heap* heap);
+
+/// @returns The current address of an object that compaction may have moved.
+static inline Obj* forwardingAddress(Obj* object) {
+    if (object != NULL && PAGE_OF(object)->evacuating) {
+        return *(Obj**)object;
+    }
+    return object;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef CLOX_INCLUDE_BULK_H
+#define CLOX_INCLUDE_BULK_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+/// @brief Number of elements in each chunk that bulk operations split an array into. Results only depend on this, not on
+/// how many threads run the chunks, so every pool size computes the same bits.
+#define BULK_CHUNK_ELEMENTS (64 * 1024)
+
+/// @brief Arrays shorter than this are processed on the calling thread alone. Can be changed from the command line.
+extern size_t parallelMinElements;
+
+/// @returns The sum of the elements.
+double bulkSum(const double* x, size_t n);
+/// @returns The dot product of two arrays of the same length.
+double bulkDot(const double* x, const double* y, size_t n);
+/// @returns The smallest element. n must be positive.
+double bulkMin(const double* x, size_t n);
+/// @returns The largest element. n must be positive.
+double bulkMax(const double* x, size_t n);
+/// @brief x *= factor
+void bulkScale(double* x, size_t n, double factor);
+/// @brief y += alpha * x
+void bulkAxpy(double* y, const double* x, size_t n, double alpha);
+
+typedef enum BulkOp {
+    BULK_ADD,
+    BULK_SUB,
+    BULK_MUL,
+    BULK_DIV,
+} BulkOp;
+
+/// @brief y = y op x, elementwise.
+void bulkElementwise(BulkOp op, double* y, const double* x, size_t n);
+/// @brief Replaces each element with the sum of it and the elements before it.
+void bulkPrefixSum(double* x, size_t n);
+/// @brief Sorts the elements in ascending order, with -0 before 0 and NaNs last.
+void bulkSort(double* x, size_t n);
+
+#endif
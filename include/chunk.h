@@ -6,7 +6,13 @@
 
 // Codes for different types of operations
 typedef enum OpCode {
+    // Gives the instruction after it a two-byte index operand, for functions with more than 256 constants or locals. Only
+    // instructions that index the constants or the locals can follow it.
+    OP_WIDE,
+
     OP_CONSTANT,
+    // Pushes the small integer in its signed two-byte operand, without a constant.
+    OP_INT,
 
     OP_NIL,
     OP_TRUE,
@@ -24,6 +30,8 @@ typedef enum OpCode {
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
 
     OP_EQUAL,
     OP_GREATER,
@@ -33,15 +41,44 @@ typedef enum OpCode {
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    // Add or subtract the small integer in their signed two-byte operand.
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
 
     OP_NOT,
     OP_NEGATE,
 
     OP_PRINT,
     OP_JUMP,
-    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_OR_POP,
+    OP_JUMP_IF_TRUE_OR_POP,
+    // Conditional branches pop what they test. Comparison branches come in pairs that test opposite ways, and each
+    // forward branch has a backward form the same distance after OP_POP_LOOP_IF_FALSE.
+    OP_POP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_TRUE,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    // Pop one value and compare it with nil.
+    OP_JUMP_IF_NIL,
+    OP_JUMP_IF_NOT_NIL,
 
     OP_LOOP,
+    OP_POP_LOOP_IF_FALSE,
+    OP_POP_LOOP_IF_TRUE,
+    OP_LOOP_IF_LESS,
+    OP_LOOP_IF_NOT_LESS,
+    OP_LOOP_IF_GREATER,
+    OP_LOOP_IF_NOT_GREATER,
+    OP_LOOP_IF_EQUAL,
+    OP_LOOP_IF_NOT_EQUAL,
+    OP_LOOP_IF_NIL,
+    OP_LOOP_IF_NOT_NIL,
+    OP_FOR_RANGE_ENTER,
+    OP_FOR_RANGE,
 
     OP_CALL,
     OP_INVOKE,
@@ -50,10 +87,16 @@ typedef enum OpCode {
     OP_CLOSE_UPVALUE,
 
     OP_RETURN,
+    OP_RETURN_NIL,
 
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+
+    OP_BUILD_LIST,
+    OP_EXTEND_LIST,
+    OP_BUILD_MAP,
+    OP_EXTEND_MAP,
 } OpCode;
 
 // Dynamic array
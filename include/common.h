@@ -6,12 +6,14 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+#define GC_COMPACTION
 
 #define DEBUG_PRINT
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
 
 //#define DEBUG_STRESS_GC
+//#define DEBUG_STRESS_COMPACTION
 //#define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
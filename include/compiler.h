@@ -4,9 +4,9 @@
 #include "chunk.h"
 #include "object.h"
 
-/// @brief Compiles source code.
+/// @brief Compiles source code. Long string literals and identifiers become slices of the source.
 /// @returns A function that contains the top-level code. If a compile-time error occurred, returns NULL.
-ObjFunction* compile(const char* source);
+ObjFunction* compile(ObjString* source);
 
 /// @brief GC-marks the compiler's roots as reachable.
 void markCompilerRoots();
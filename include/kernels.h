@@ -0,0 +1,51 @@
+#ifndef CLOX_INCLUDE_KERNELS_H
+#define CLOX_INCLUDE_KERNELS_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+/// @brief Instruction set levels that the numeric kernels are written for, from least to most capable.
+typedef enum KernelLevel {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+} KernelLevel;
+
+/// @brief Alignment of the storage the kernels work on, in bytes. Enough for the widest vector.
+#define KERNEL_ALIGNMENT 32
+
+/// @brief Bulk operations on arrays of doubles. Every level computes bit-identical results: reductions add their elements
+/// into the same eight partial sums in the same order, and no level fuses multiplies with adds.
+typedef struct {
+    KernelLevel level;
+    double (*sum)(const double* x, size_t n);
+    double (*dot)(const double* x, const double* y, size_t n);
+    // min and max need n > 0. If x holds a NaN, they return NaN.
+    double (*min)(const double* x, size_t n);
+    double (*max)(const double* x, size_t n);
+    // x *= factor
+    void (*scale)(double* x, size_t n, double factor);
+    // y += alpha * x
+    void (*axpy)(double* y, const double* x, size_t n, double alpha);
+    // y = y op x, elementwise
+    void (*add)(double* y, const double* x, size_t n);
+    void (*sub)(double* y, const double* x, size_t n);
+    void (*mul)(double* y, const double* x, size_t n);
+    void (*div)(double* y, const double* x, size_t n);
+    // Replaces each element with the sum of it and the elements before it, starting from the given carry.
+    // @returns The last sum, which is the carry to continue the next elements with.
+    double (*prefixSum)(double* x, size_t n, double carry);
+} Float64Kernels;
+
+/// @brief The kernels in use. Set by selectKernels().
+extern Float64Kernels float64Kernels;
+
+/// @returns The most capable kernel level that the CPU supports.
+KernelLevel detectKernelLevel();
+/// @brief Switches to the kernels of the given level, or the most capable supported one below it.
+void selectKernels(KernelLevel level);
+/// @returns The name of a kernel level.
+const char* kernelLevelName(KernelLevel level);
+
+#endif
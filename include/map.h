@@ -0,0 +1,51 @@
+#ifndef CLOX_INCLUDE_MAP_H
+#define CLOX_INCLUDE_MAP_H
+
+#include "common.h"
+#include "value.h"
+
+typedef struct {
+    Value key;
+    Value value;
+    uint32_t hash;
+    // Removed entries keep their place until the map is rebuilt, so that the others stay in insertion order.
+    bool removed;
+} MapEntry;
+
+/// @brief A hash map keyed by arbitrary values. Its entries are kept in insertion order in one array, and a separate array of
+/// slots maps hashes to them.
+typedef struct {
+    // Number of live entries.
+    int count;
+    // Number of entries in use, counting removed ones.
+    int entryCount;
+    int entryCapacity;
+    MapEntry* entries;
+    // Each slot holds the index of an entry, or one of the markers for empty and removed slots. Always larger than the entry
+    // capacity, so that probing finds an empty slot.
+    int slotCapacity;
+    int32_t* slots;
+} Map;
+
+/// @brief Initializes an empty map.
+void initMap(Map* map);
+/// @brief Frees a map's arrays.
+void freeMap(Map* map);
+/// @brief Makes room for the given number of entries, so that adding them doesn't grow the map.
+void mapReserve(Map* map, int count);
+/// @brief Looks for the entry with the given key and puts its value in the out value. The key must be reachable by the GC.
+/// @returns Whether the entry was found.
+bool mapGet(Map* map, Value key, Value* out);
+/// @brief Sets the given key's value. The key and value must be reachable by the GC.
+/// @returns Whether a new key was added to the map.
+bool mapSet(Map* map, Value key, Value value);
+/// @brief Removes the entry with the given key. The key must be reachable by the GC.
+/// @returns Whether the entry was found and removed.
+bool mapRemove(Map* map, Value key);
+
+/// @brief GC-marks all keys and values in a map as reachable.
+void markMap(Map* map);
+/// @brief Updates the map's references to objects that compaction has moved, rehashing the keys that are hashed by address.
+void relocateMap(Map* map);
+
+#endif
@@ -16,12 +16,57 @@
 /// @brief Frees a dynamic array by delegating to reallocate().
 #define FREE_ARRAY(type, pointer, count) reallocate(pointer, sizeof(type) * count, 0)
 
+/// @brief Knobs that decide when the garbage collector runs and how large the heap may grow. Sizes are in bytes.
+typedef struct GCPolicy {
+    // Heap size at which the first collection runs.
+    size_t initialHeapSize;
+    // After a collection, the next one runs once the heap has grown to this multiple of the live size.
+    double growthFactor;
+    // The collection threshold never drops below this.
+    size_t minHeapSize;
+    // Hard limit. An allocation by running code that would exceed it raises an out-of-memory runtime error. 0 means
+    // unlimited.
+    size_t maxHeapSize;
+    // Once the heap grows past this, collections run more often. 0 means no soft limit.
+    size_t softLimit;
+    // Computes the next collection threshold from the bytes that survived a collection.
+    size_t (*nextThreshold)(const struct GCPolicy* policy, size_t liveBytes);
+} GCPolicy;
+
+/// @brief Number of buckets in the GC pause histogram. Bucket i counts pauses shorter than 2^i microseconds, the last one
+/// everything longer.
+#define GC_PAUSE_BUCKETS 20
+
+/// @brief Running totals of the garbage collector's and allocator's work.
+typedef struct {
+    uint64_t collections;
+    uint64_t compactions;
+    uint64_t bytesAllocated;
+    uint64_t bytesFreed;
+    uint64_t objectsAllocated[OBJ_TYPE_COUNT];
+    uint64_t objectsFreed[OBJ_TYPE_COUNT];
+    // Heap size right after the most recent collection.
+    size_t liveBytesAfterGC;
+    uint64_t pauseTotalNanos;
+    uint64_t pauseMaxNanos;
+    uint64_t pauseHistogram[GC_PAUSE_BUCKETS];
+} GCStats;
+
+/// @brief Initializes a GC policy with the default settings.
+void initGCPolicy(GCPolicy* policy);
+/// @brief The default GCPolicy.nextThreshold: grows by the growth factor, clamped to the policy's limits.
+size_t defaultNextThreshold(const GCPolicy* policy, size_t liveBytes);
+/// @brief Makes the given policy the VM's GC policy and restarts its collection threshold at the initial heap size.
+void setGCPolicy(const GCPolicy* policy);
+
 /// @brief Used for all dynamic memory management including allocation, freeing, and resizing.
 /// @param pointer Pointer to dynamic memory.
 /// @param oldSize If 0, allocate a new block.
 /// @param newSize If 0, free allocation. Otherwise, resize.
 /// @return Pointer that points to the newly allocated block.
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+/// @brief Allocates memory for a GC-managed object from the VM's heap, collecting garbage first if needed.
+void* allocateObjectMemory(size_t size);
 
 /// @brief GC-Marks an object as reachable.
 void markObject(Obj* object);
@@ -29,8 +74,22 @@ void markObject(Obj* object);
 void markValue(Value value);
 /// @brief Triggers the garbage collector.
 void collectGarbage();
+/// @brief Collects garbage, then moves objects out of sparsely occupied pages and updates every reference to them.
+/// Must only be called where no C code holds a raw pointer to a heap object.
+void compactHeap();
+/// @brief Updates an object reference held in a value after compaction has moved objects.
+void relocateValue(Value* value);
+
+/// @brief Copies the VM's GC statistics into the given struct.
+void getGCStats(GCStats* stats);
+/// @brief Prints the VM's GC statistics to stderr.
+void printGCStats();
+/// @brief Prints the probe statistics of each table role, with the sizes of the live tables, to stderr.
+void printTableStats();
+/// @returns A readable name for the given object type.
+const char* objTypeName(ObjType type);
 
-/// @brief Frees the VM's linked list of objects.
+/// @brief Frees every object in the VM's heap.
 void freeObjects();
 
 #endif
\ No newline at end of file
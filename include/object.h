@@ -3,12 +3,14 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "kernels.h"
+#include "map.h"
 #include "value.h"
 #include "table.h"
 
 
 /// @returns The ObjType of the object held by the given value.
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) (objType(AS_OBJ(value)))
 
 /// @returns Whether the given Value holds a bound method object.
 #define IS_BOUND_METHOD(value) (isObjType(value, OBJ_BOUND_METHOD))
@@ -16,14 +18,24 @@
 #define IS_CLASS(value) (isObjType(value, OBJ_CLASS))
 /// @returns Whether the given Value holds a closure object.
 #define IS_CLOSURE(value) (isObjType(value, OBJ_CLOSURE))
+/// @returns Whether the given Value holds a Float64Array object.
+#define IS_FLOAT64_ARRAY(value) (isObjType(value, OBJ_FLOAT64_ARRAY))
 /// @returns Whether the given Value holds a function object.
 #define IS_FUNCTION(value) (isObjType(value, OBJ_FUNCTION))
 /// @returns Whether the given Value holds an instance object.
 #define IS_INSTANCE(value) (isObjType(value, OBJ_INSTANCE))
+/// @returns Whether the given Value holds a list object.
+#define IS_LIST(value) (isObjType(value, OBJ_LIST))
+/// @returns Whether the given Value holds a map object.
+#define IS_MAP(value) (isObjType(value, OBJ_MAP))
 /// @returns Whether the given Value holds a function object.
 #define IS_NATIVE(value) (isObjType(value, OBJ_NATIVE))
+/// @returns Whether the given Value holds a rope object.
+#define IS_ROPE(value) (isObjType(value, OBJ_ROPE))
 /// @returns Whether the given Value holds a string object.
 #define IS_STRING(value) (isObjType(value, OBJ_STRING))
+/// @returns Whether the given Value holds a string in either of its representations.
+#define IS_STRING_OR_ROPE(value) (IS_STRING(value) || IS_ROPE(value))
 
 /// @returns The bount method object held by the given Value.
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -31,56 +43,110 @@
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 /// @returns The closure object held by the given Value.
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+/// @returns The Float64Array object held by the given Value.
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array*)AS_OBJ(value))
 /// @returns The function object held by the given Value.
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 /// @returns The instance object held by the given Value.
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+/// @returns The list object held by the given Value.
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+/// @returns The map object held by the given Value.
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
 /// @returns The C function pointer from the native-function object held by the given Value.
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+/// @returns The rope object held by the given Value.
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 /// @returns The string object held by the given Value.
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
-/// @returns The null-terminated c-string in the string object held by the given Value.
-#define AS_CSTRING(value) (AS_STRING(value)->chars)
 
 typedef enum ObjType {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FLOAT64_ARRAY,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
+    OBJ_MAP,
     OBJ_NATIVE,
+    OBJ_ROPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
 
+/// @brief Number of object types. Must follow the last ObjType.
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+/// @brief Bits of an object's header word that hold its ObjType.
+#define OBJ_HEADER_TYPE_MASK 0xffu
+
+// Objects put a 4-byte field right after the header where they have one, so that header and field share the first 8 bytes.
 struct Obj {
-    ObjType type;
-    bool isMarked;
-    struct Obj* next;
+    // Bits 0-7 hold the ObjType and bits 8-11 are reserved for a GC age; the rest are free for per-object flags.
+    // The mark bit is kept in the allocator's side bitmap, and the allocator's pages are walked instead of a list of objects.
+    uint32_t header;
 };
 
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
-    Chunk chunk;
+    // The most stack slots its frame takes up at once, counting the callee, the locals and the temporaries.
+    int stackSize;
     ObjString* name;
+    Chunk chunk;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+/// @brief A function implemented in C. It puts its return value in result.
+/// @returns Whether the call succeeded. A native that fails reports its own runtime error.
+typedef bool (*NativeFn)(int argCount, Value* args, Value* result);
 
 typedef struct {
     Obj obj;
     NativeFn function;
 } ObjNative;
 
+/// @brief Header flag of strings that are in vm.strings. An interned string is only equal to itself.
+#define STRING_FLAG_INTERNED (1u << 12)
+/// @brief Header flag of strings whose hash field has been computed.
+#define STRING_FLAG_HASHED (1u << 13)
+/// @brief Header flag of strings that are an ObjSlice.
+#define STRING_FLAG_SLICE (1u << 14)
+/// @brief Shorter slices are copied instead, since the copy is no larger than the slice object.
+#define SLICE_MIN_LENGTH 32
+
 struct ObjString {
     Obj obj;
-    int length;
-    char* chars;
+    // Only valid once STRING_FLAG_HASHED is set; use stringHash().
     uint32_t hash;
+    int length;
+    // Null-terminated, stored inline after the object. Use stringChars(), which also handles slices.
+    char chars[];
 };
 
+/// @brief A string whose characters are a range of another object, which it keeps alive. It is an OBJ_STRING with
+/// STRING_FLAG_SLICE set, and starts with the same fields as ObjString. Its characters aren't null-terminated.
+typedef struct {
+    Obj obj;
+    uint32_t hash;
+    int length;
+    Obj* owner;
+    const char* start;
+} ObjSlice;
+
+/// @brief Concatenations shorter than this are copied right away; longer ones make a rope.
+#define ROPE_MIN_LENGTH 64
+
+/// @brief A string made by concatenation whose characters are only copied out when they are needed.
+typedef struct {
+    Obj obj;
+    int length;
+    // Each side is an ObjString or another ObjRope. Once the rope is flattened, left is the flat ObjString and right is NULL.
+    Obj* left;
+    Obj* right;
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value closed;
@@ -90,21 +156,44 @@ typedef struct ObjUpvalue {
 
 typedef struct {
     Obj obj;
-    ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjFunction* function;
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
 typedef struct {
     Obj obj;
     ObjString* name;
-    Table methods;
+    // The init method, if the class or a superclass has one.
+    ObjClosure* initializer;
+    // Methods indexed by selector. Selectors the class doesn't define have NULL slots.
+    ObjClosure** methods;
+    int methodCount;
+    // Methods whose selectors are past the end of methods, keyed by name. The array only grows while it stays dense enough,
+    // so a class defining a few methods with far-apart selectors doesn't get an array sized to the highest one.
+    Table sparseMethods;
+    // Instances created so far, counted up to one past the end of slack tracking.
+    int instanceCount;
+    // Most fields that an instance created during slack tracking has had.
+    int fieldCount;
 } ObjClass;
 
+/// @brief Number of instances a class creates with an empty field table, to learn how many fields they get. Later instances
+/// are created with room for that many fields inline.
+#define SLACK_TRACKING_INSTANCES 8
+
+/// @brief Length up to which a class's method array may grow however few methods it holds.
+#define METHODS_DENSE_MIN 16
+/// @brief Most slots a class's method array may have per method defined in it, past METHODS_DENSE_MIN.
+#define METHODS_SLOTS_PER_METHOD 4
+
 typedef struct {
     Obj obj;
     ObjClass* loxClass;
     Table fields;
+    // Inline storage for the field table of an instance created after slack tracking: the entries, followed by the control
+    // bytes.
+    Entry inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -113,31 +202,101 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+typedef struct {
+    Obj obj;
+    int count;
+    int capacity;
+    // Kept outside the object so that the list can grow in place.
+    Value* items;
+} ObjList;
+
+typedef struct {
+    Obj obj;
+    Map map;
+} ObjMap;
+
+/// @returns The number of bytes allocated for the storage of a Float64Array, with room to align it.
+#define FLOAT64_ARRAY_STORAGE_SIZE(length) (sizeof(double) * (size_t)(length) + KERNEL_ALIGNMENT)
+
+/// @brief A fixed-length array of unboxed doubles, for the numeric kernels.
+typedef struct {
+    Obj obj;
+    int length;
+    // Aligned to KERNEL_ALIGNMENT within storage, which is what was allocated.
+    double* data;
+    void* storage;
+} ObjFloat64Array;
+
 /// @brief Constructor-like for bound method objects.
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 /// @brief Constructor-like for class objects.
 ObjClass* newClass(ObjString* name);
+/// @brief Creates a Float64Array of the given length with all elements zero.
+ObjFloat64Array* newFloat64Array(int length);
 /// @brief Creates a closure object that closes over the given function object.
 ObjClosure* newClosure(ObjFunction* function);
 /// @brief Creates an empty-initialized function.
 ObjFunction* newFunction();
 /// @brief Constructor-like for instance objects.
 ObjInstance* newInstance(ObjClass* loxClass);
+/// @brief Creates a list holding a copy of the count values starting at items, which may point into the VM stack.
+ObjList* newList(Value* items, int count);
+/// @brief Appends a value to a list, growing its storage as needed. The value must be reachable by the GC.
+void listAppend(ObjList* list, Value value);
+/// @brief Appends a copy of the count values starting at items, which may point into the VM stack, to a list.
+void listAppendAll(ObjList* list, Value* items, int count);
+/// @brief Creates an empty map.
+ObjMap* newMap();
 /// @brief A constructor-like function for creating native functions.
 ObjNative* newNative(NativeFn function);
 
-/// @returns An ObjString* that takes ownership of the given chars.
-ObjString* takeString(char* chars, int length);
+/// @brief Allocates an uninterned string with room for length chars, which the caller fills in.
+ObjString* newString(int length);
+/// @brief Interns a string, as is needed to use it as a table key.
+/// @returns The interned string, which is an existing equal string if there is one.
+ObjString* internString(ObjString* string);
+/// @brief Uses the wyhash algorithm, which consumes the characters 8 or 16 bytes at a time.
+/// @returns The hash of the characters, as strings store it.
+uint32_t hashString(const char* key, int length);
+/// @returns The hash of a string, computing it on first use.
+uint32_t stringHash(ObjString* string);
+/// @brief Compares two strings or ropes by content, flattening ropes of equal length. Both must be reachable by the GC.
+/// @returns Whether the two are equal.
+bool stringsEqual(Obj* a, Obj* b);
 /// @brief Allocates a new string on the heap from the given string in the source code.
 ObjString* copyString(const char* chars, int length);
+/// @brief Like copyString(), but a long enough range of the parent's characters is referenced instead of copied.
+ObjString* sliceString(ObjString* parent, const char* chars, int length);
+/// @brief Concatenates two strings or ropes, neither of them empty, into a rope.
+ObjRope* newRope(Obj* left, Obj* right);
+/// @brief Copies a rope's characters into a flat string, which the rope keeps. The rope must be reachable by the GC.
+/// @returns The flat string.
+ObjString* flattenRope(ObjRope* rope);
+/// @brief Copies the characters of a string or rope to dest, without allocating.
+void copyStringChars(Obj* string, char* dest);
+/// @returns The length of a string or rope.
+int stringLength(Obj* string);
 /// @brief Constructor-like function for upvalue objects;
 ObjUpvalue* newUpvalue(Value* slot);
 /// @brief Prints a representation of an object value.
 void printObject(Value value);
 
+/// @returns The type stored in an object's header.
+static inline ObjType objType(Obj* object) {
+    return (ObjType)(object->header & OBJ_HEADER_TYPE_MASK);
+}
+
+/// @returns The characters of a string, which are only null-terminated if it isn't a slice.
+static inline const char* stringChars(ObjString* string) {
+    if (string->obj.header & STRING_FLAG_SLICE) {
+        return ((ObjSlice*)string)->start;
+    }
+    return string->chars;
+}
+
 /// @returns Whether the given value holds an object of the given type.
 static inline bool isObjType(Value value, ObjType type) {
-    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+    return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef CLOX_INCLUDE_POOL_H
+#define CLOX_INCLUDE_POOL_H
+
+#include "common.h"
+
+/// @brief Largest number of threads the pool runs, counting the thread that hands it work.
+#define POOL_MAX_THREADS 256
+
+/// @brief Does one chunk of a job. Chunks of the same job may run at the same time on different threads.
+typedef void (*ChunkFn)(void* context, int chunk);
+
+/// @returns The number of processors online, which is the default pool size.
+int defaultThreadCount();
+/// @brief Sets the number of threads that run jobs, counting the thread that hands them out. 1 runs everything on that
+/// thread. The worker threads are only started by the first parallel job.
+void setThreadCount(int threadCount);
+/// @returns The number of threads that run jobs, counting the thread that hands them out.
+int threadCount();
+/// @brief Stops and joins the worker threads.
+void freeThreadPool();
+
+/// @brief Calls fn for every chunk below chunkCount and returns once all of them are done. If parallel is set and the pool
+/// has worker threads, the chunks are spread over them and the calling thread, otherwise they run in order on the calling
+/// thread.
+void runChunks(ChunkFn fn, void* context, int chunkCount, bool parallel);
+
+#endif
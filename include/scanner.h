@@ -7,6 +7,8 @@ typedef enum TokenType {
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
     TOKEN_COLON,
     TOKEN_COMMA,
     TOKEN_DOT,
@@ -20,6 +22,7 @@ typedef enum TokenType {
     // One or two character tokens.
     TOKEN_BANG,
     TOKEN_BANG_EQUAL,
+    TOKEN_DOT_DOT,
     TOKEN_EQUAL,
     TOKEN_EQUAL_EQUAL,
     TOKEN_GREATER,
@@ -40,6 +43,7 @@ typedef enum TokenType {
     TOKEN_FOR,
     TOKEN_FUN,
     TOKEN_IF,
+    TOKEN_IN,
     TOKEN_NIL,
     TOKEN_OR,
     TOKEN_PRINT,
@@ -63,5 +67,7 @@ typedef struct {
 
 void initScanner(const char* source);
 Token scanToken();
+/// @returns The token that the next call to scanToken will return, without consuming it.
+Token peekToken();
 
 #endif
\ No newline at end of file
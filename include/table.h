@@ -9,14 +9,68 @@ typedef struct {
     Value value;
 } Entry;
 
+/// @brief What a hash table is used for, which probe statistics are grouped by.
+typedef enum TableRole {
+    TABLE_GLOBALS,
+    TABLE_STRINGS,
+    TABLE_METHODS,
+    TABLE_FIELDS,
+} TableRole;
+
+/// @brief Number of table roles. Must follow the last TableRole.
+#define TABLE_ROLE_COUNT (TABLE_FIELDS + 1)
+
+/// @brief Probe statistics of all tables with the same role.
 typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    // Groups of slots examined, summed over all lookups.
+    uint64_t groupsProbed;
+    // Full slots whose key had to be compared, summed over all lookups.
+    uint64_t keyCompares;
+    int maxGroupsProbed;
+    uint64_t grows;
+    uint64_t shrinks;
+    // Rehashes that kept the capacity and only dropped deleted slots.
+    uint64_t rehashes;
+
+    // Totals over the live tables, filled in by sampleTableStats().
+    int tables;
+    size_t capacity;
+    size_t count;
+    size_t tombstones;
+} TableStats;
+
+/// @brief Whether table operations record probe statistics. Off by default, so that they only cost a branch.
+extern bool tableStatsEnabled;
+
+typedef struct {
+    // Number of live entries.
     int count;
+    // Number of deleted slots that still break probe sequences.
+    int tombstones;
     int capacity;
+    // A TableRole, narrowed so that the flag below fits next to it.
+    uint8_t role;
+    // Whether the arrays are stored inside the table's owner instead of being allocated on their own.
+    bool inlineArrays;
+    // One control byte per slot: the low 7 bits of the key's hash if the slot is full, or an empty or deleted marker. The
+    // array is followed by copies of its first bytes, so that a group of slots can be loaded at any index.
+    uint8_t* control;
     Entry* entries;
 } Table;
 
-/// @brief Initializes a hash table.
-void initTable(Table* table);
+/// @brief Initializes a hash table with the given role.
+void initTable(Table* table, TableRole role);
+/// @brief Initializes an empty hash table of the given capacity whose arrays are stored in the given memory, which must hold
+/// tableInlineSize(capacity) bytes. The memory is given up once the table outgrows it.
+void initTableInline(Table* table, TableRole role, int capacity, void* storage);
+/// @brief Points a table with inline arrays at the new address of its storage, after its owner has been moved.
+void tableMoveInline(Table* table, void* storage);
+/// @returns The smallest capacity that holds the given number of entries without growing.
+int tableCapacityFor(int count);
+/// @returns The number of bytes the arrays of a table with the given capacity take up.
+size_t tableInlineSize(int capacity);
 /// @brief Frees a hash table.
 void freeTable(Table* table);
 /// @brief Looks for the entry with the given key and puts it in the out value.
@@ -25,9 +79,13 @@ bool tableGet(Table* table, ObjString* key, Value* out);
 /// @brief Sets the given key's value.
 /// @returns Whether a new key was added to the table.
 bool tableSet(Table* table, ObjString* key, Value value);
-/// @brief "Deletes" an entry from the table by replacing it with a tombstone.
+/// @brief Deletes an entry from the table by marking its slot as deleted.
 /// @returns whether the entry was found and deleted.
 bool tableDelete(Table* table, ObjString* key);
+/// @brief Rehashes a table that has many deleted slots, shrinking it if its entries use little of its capacity.
+/// Runs after the sweep for the string table and on every tableDelete. Instance field tables need no call: Lox has no way to
+/// remove a field, so they never lose entries.
+void tableCompact(Table* table);
 /// @brief Copies all entries from one hash table to another.
 void tableAddAll(Table* from, Table* to);
 /// @brief Finds an entry whose key contains the given string.
@@ -37,6 +95,15 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 void tableRemoveWhite(Table* table);
 /// @brief GC-Marks all keys and values in a table as reachable.
 void markTable(Table* table);
+/// @brief Updates the table's references to objects that compaction has moved.
+void relocateTable(Table* table);
+
+/// @returns The probe statistics of the tables with the given role.
+TableStats* tableStats(TableRole role);
+/// @brief Adds the table's current size to the live totals of its role's statistics.
+void sampleTableStats(Table* table);
+/// @returns The name of a table role.
+const char* tableRoleName(TableRole role);
 
 /// @brief Debug prints a table.
 void printTable(Table* table);
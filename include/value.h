@@ -12,6 +12,9 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1
 #define TAG_FALSE 2
 #define TAG_TRUE 3
+/// @brief Set in a quiet NaN that holds a 32-bit integer in its low bits. Numbers that are small integers are kept this way,
+/// so that integer arithmetic doesn't go through floating point.
+#define TAG_INT ((uint64_t)0x0001000000000000)
 
 typedef uint64_t Value;
 
@@ -19,15 +22,20 @@ typedef uint64_t Value;
 #define IS_BOOL(value) ((value | 1) == TRUE_VAL)
 /// @returns Whether the given value holds nil.
 #define IS_NIL(value) (value == NIL_VAL)
-/// @returns Whether the given value holds a number.
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+/// @returns Whether the given value holds a number stored as a small integer.
+#define IS_INT(value) (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+/// @returns Whether the given value holds a number. Only nil, the bools and objects have exactly the QNAN bits set among
+/// the top sixteen, ignoring the sign.
+#define IS_NUMBER(value) (((value) & ~SIGN_BIT & ~(uint64_t)0xffffffffffff) != QNAN)
 /// @returns Whether the given value holds an object.
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 /// @returns The bool held by the given value.
 #define AS_BOOL(value) (value == TRUE_VAL)
-/// @returns The number held by the given value.
-#define AS_NUMBER(value) valueToNum(value)
+/// @returns The number held by the given value, converted to a double if it is a small integer.
+#define AS_NUMBER(value) valueToNumber(value)
+/// @returns The small integer held by the given value.
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
 /// @returns The object held by the given value.
 #define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -39,6 +47,8 @@ typedef uint64_t Value;
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 /// @returns A value constructed from the given number.
 #define NUMBER_VAL(num) numToValue(num)
+/// @returns A value constructed from the given 32-bit integer.
+#define INT_VAL(num) ((Value)(QNAN | TAG_INT | (uint64_t)(uint32_t)(num)))
 /// @returns A value constructed from the given object.
 #define OBJ_VAL(object) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
 
@@ -60,6 +70,10 @@ static inline double valueToNum(Value value) {
     data.value = value;
     return data.num;
 }
+/// @returns The number held by a value, whether it is stored as a double or a small integer.
+static inline double valueToNumber(Value value) {
+    return IS_INT(value) ? (double)AS_INT(value) : valueToNum(value);
+}
 
 #else
 
@@ -85,6 +99,8 @@ typedef struct {
 #define IS_NIL(value) (value.type == VAL_NIL)
 /// @returns Whether the given value holds a number.
 #define IS_NUMBER(value) (value.type == VAL_NUMBER)
+/// @returns Whether the given value holds a small integer. Only NaN-boxed values keep them apart from other numbers.
+#define IS_INT(value) false
 /// @returns Whether the given value holds an object.
 #define IS_OBJ(value) (value.type == VAL_OBJ)
 
@@ -92,6 +108,8 @@ typedef struct {
 #define AS_BOOL(value) (value.as.boolean)
 /// @returns The number held by the given value.
 #define AS_NUMBER(value) (value.as.number)
+/// @returns The number held by the given value, truncated to a 32-bit integer.
+#define AS_INT(value) ((int32_t)value.as.number)
 /// @returns The object held by the given value.
 #define AS_OBJ(value) (value.as.obj)
 
@@ -101,6 +119,8 @@ typedef struct {
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 /// @returns A value constructed from the given number.
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+/// @returns A value constructed from the given 32-bit integer.
+#define INT_VAL(value) NUMBER_VAL((double)(value))
 /// @returns A value constructed from the given object.
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)(object)}})
 
@@ -112,8 +132,21 @@ typedef struct {
     Value* values;
 } ValueArray;
 
+/// @returns A well-mixed 32-bit hash of a 64-bit word.
+static inline uint32_t hashBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
 /// @returns Whether the two given values are equal.
 bool valuesEqual(Value a, Value b);
+/// @returns Whether two values have the same representation: numbers with the same bits, or the same object. Unlike
+/// valuesEqual, a small integer differs from the equal double, and -0 from 0.
+bool valuesIdentical(Value a, Value b);
+/// @returns A hash of a value's representation, the same for identical values.
+uint32_t hashValueIdentity(Value value);
 
 /// @brief Initializes an empty value array.
 void initValueArray(ValueArray* array);
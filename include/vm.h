@@ -1,13 +1,22 @@
 #ifndef CLOX_INCLUDE_VM_H
 #define CLOX_INCLUDE_VM_H
 
+#include <setjmp.h>
+
+#include "allocator.h"
 #include "chunk.h"
+#include "memory.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/// @brief Stack slots kept free above the deepest frame, for the objects natives and runtime helpers push to keep them
+/// reachable while they allocate.
+#define STACK_HEADROOM 8
+/// @brief Number of distinct method names a program may use. Selectors are two-byte operands.
+#define SELECTOR_MAX (UINT16_MAX + 1)
 
 typedef struct {
     ObjClosure* closure;
@@ -15,6 +24,21 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+/// @brief A method of a built-in type, called with the receiver's arguments still on the stack.
+/// @returns Whether the call succeeded. A method that fails reports its own runtime error.
+typedef bool (*BuiltinMethodFn)(Obj* receiver, Value* args, Value* result);
+
+typedef struct {
+    BuiltinMethodFn function;
+    int arity;
+} BuiltinMethod;
+
+/// @brief The methods of a built-in type indexed by selector, with NULL functions for selectors that aren't its methods.
+typedef struct {
+    BuiltinMethod* methods;
+    int count;
+} BuiltinMethods;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -23,12 +47,27 @@ typedef struct {
     Value* stackTop;
     Table globals;
     Table strings;
-    ObjString* initString;
+    // Maps each method name to its selector, the index of the method in every class's method array.
+    Table selectors;
+    // The method name of each selector.
+    ValueArray selectorNames;
+    int initSelector;
+    BuiltinMethods listMethods;
+    BuiltinMethods mapMethods;
+    BuiltinMethods float64ArrayMethods;
     ObjUpvalue* openUpvalues;
 
     size_t bytesAllocated;
     size_t nextGC;
-    Obj* objects;
+    GCPolicy gcPolicy;
+    GCStats gcStats;
+    // Where an allocation that exceeds the heap limit unwinds to. NULL when no script is running.
+    jmp_buf* allocationFailure;
+    Heap heap;
+    // Set by a collection that left the heap fragmented; the VM compacts at its next safepoint.
+    bool compactionPending;
+    // Set while a collection runs. Allocations made by the collector itself don't trigger another one.
+    bool collecting;
 
     int grayCount;
     int grayCapacity;
@@ -50,6 +89,11 @@ void freeVM();
 
 /// @brief Interprets a string of source code.
 InterpretResult interpret(const char* source);
+/// @brief Interprets source code held in a string object. Long literals and identifiers are compiled to slices of it.
+InterpretResult interpretSource(ObjString* source);
+
+/// @returns The selector of the given method name. A name that has none yet is given the next one.
+int selectorFor(ObjString* name);
 
 /// @brief Pushes a value onto the VM's stack.
 void push(Value value);
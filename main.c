@@ -1,10 +1,16 @@
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "include/bulk.h"
 #include "include/chunk.h"
 #include "include/common.h"
 #include "include/debug.h"
+#include "include/kernels.h"
+#include "include/memory.h"
+#include "include/object.h"
+#include "include/pool.h"
 #include "include/vm.h"
 
 /// @brief Begin REPL.
@@ -22,8 +28,8 @@ static void repl() {
     }
 }
 
-/// @brief Reads a file and returns its contents.
-static char* readFile(const char* path) {
+/// @brief Reads a file straight into a string object, which the compiled code's long literals then reference.
+static ObjString* readFile(const char* path) {
     FILE* file = fopen(path, "rb");
     if (file == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
@@ -34,50 +40,186 @@ static char* readFile(const char* path) {
     size_t fileSize = ftell(file);
     rewind(file);
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
+    if (fileSize > INT_MAX) {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
         exit(74);
     }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    ObjString* source = newString((int)fileSize);
+    size_t bytesRead = fread(source->chars, sizeof(char), fileSize, file);
     if (bytesRead < fileSize) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
         exit(74);
     }
-    buffer[bytesRead] = '\0';
 
     fclose(file);
-    return buffer;
+    return source;
 }
 
 /// @brief Execute code in a file.
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+/// @returns The process exit code for the result.
+static int runFile(const char* path) {
+    ObjString* source = readFile(path);
+    InterpretResult result = interpretSource(source);
 
     if (result == INTERPRET_COMPILE_ERROR) {
-        exit(65);
+        return 65;
     }
     if (result == INTERPRET_RUNTIME_ERROR) {
-        exit(70);
+        return 70;
     }
+    return 0;
+}
+
+/// @brief Prints the command-line usage and exits.
+static void usage() {
+    fprintf(stderr,
+            "Usage: clox [options] [path]\n"
+            "  --gc-initial-heap=SIZE  Heap size at which the first collection runs\n"
+            "  --gc-growth=FACTOR      Heap growth factor between collections\n"
+            "  --gc-min-heap=SIZE      Lowest collection threshold\n"
+            "  --gc-max-heap=SIZE      Hard heap limit; exceeding it is a runtime error\n"
+            "  --gc-soft-limit=SIZE    Heap size past which collections run more often\n"
+            "  --gc-stats              Print GC statistics to stderr on exit\n"
+            "  --table-stats           Print hash table probe statistics to stderr on exit\n"
+            "  --kernels=LEVEL         Use the scalar, sse2 or avx2 numeric kernels, if the CPU supports them\n"
+            "  --threads=N             Threads that run bulk array operations; defaults to the processor count\n"
+            "  --parallel-min=N        Shortest array whose bulk operations are split over the threads\n"
+            "SIZE is a byte count with an optional K, M or G suffix.\n");
+    exit(64);
+}
+
+/// @brief Parses a byte count with an optional K, M or G suffix.
+/// @returns Whether the text was a valid size.
+static bool parseSize(const char* text, size_t* out) {
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text) {
+        return false;
+    }
+    switch (*end) {
+        case 'G':
+        case 'g':
+            size *= 1024;
+            // Fall through
+        case 'M':
+        case 'm':
+            size *= 1024;
+            // Fall through
+        case 'K':
+        case 'k':
+            size *= 1024;
+            ++end;
+            break;
+    }
+    *out = (size_t)size;
+    return *end == '\0';
+}
+
+/// @returns If the argument is the given option, the text after its '=', otherwise NULL.
+static const char* optionValue(const char* arg, const char* option) {
+    size_t length = strlen(option);
+    if (strncmp(arg, option, length) == 0 && arg[length] == '=') {
+        return arg + length + 1;
+    }
+    return NULL;
+}
+
+/// @brief Parses the name of a kernel level.
+/// @returns Whether the text named one.
+static bool parseKernelLevel(const char* text, KernelLevel* out) {
+    for (int level = KERNEL_SCALAR; level <= KERNEL_AVX2; ++level) {
+        if (strcmp(text, kernelLevelName((KernelLevel)level)) == 0) {
+            *out = (KernelLevel)level;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Applies a GC option to the given policy.
+/// @returns Whether the argument was a valid GC option.
+static bool parseGCOption(const char* arg, GCPolicy* policy) {
+    const char* value;
+    if ((value = optionValue(arg, "--gc-initial-heap")) != NULL) {
+        return parseSize(value, &policy->initialHeapSize);
+    }
+    if ((value = optionValue(arg, "--gc-min-heap")) != NULL) {
+        return parseSize(value, &policy->minHeapSize);
+    }
+    if ((value = optionValue(arg, "--gc-max-heap")) != NULL) {
+        return parseSize(value, &policy->maxHeapSize);
+    }
+    if ((value = optionValue(arg, "--gc-soft-limit")) != NULL) {
+        return parseSize(value, &policy->softLimit);
+    }
+    if ((value = optionValue(arg, "--gc-growth")) != NULL) {
+        char* end;
+        policy->growthFactor = strtod(value, &end);
+        return end != value && *end == '\0' && policy->growthFactor >= 1.0;
+    }
+    return false;
 }
 
 int main(int argc, char *argv[]) {
     initVM();
 
-    if (argc == 1) {
-        repl();
+    GCPolicy policy = vm.gcPolicy;
+    const char* path = NULL;
+    bool dumpGCStats = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--gc-stats") == 0) {
+            dumpGCStats = true;
+        }
+        else if (strcmp(argv[i], "--table-stats") == 0) {
+            tableStatsEnabled = true;
+        }
+        else if (optionValue(argv[i], "--kernels") != NULL) {
+            KernelLevel level;
+            if (!parseKernelLevel(optionValue(argv[i], "--kernels"), &level)) {
+                usage();
+            }
+            selectKernels(level);
+        }
+        else if (optionValue(argv[i], "--threads") != NULL) {
+            size_t threads;
+            if (!parseSize(optionValue(argv[i], "--threads"), &threads) || threads < 1 || threads > POOL_MAX_THREADS) {
+                usage();
+            }
+            setThreadCount((int)threads);
+        }
+        else if (optionValue(argv[i], "--parallel-min") != NULL) {
+            if (!parseSize(optionValue(argv[i], "--parallel-min"), &parallelMinElements)) {
+                usage();
+            }
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            if (!parseGCOption(argv[i], &policy)) {
+                usage();
+            }
+        }
+        else if (path == NULL) {
+            path = argv[i];
+        }
+        else {
+            usage();
+        }
     }
-    else if (argc == 2) {
-        runFile(argv[1]);
+    setGCPolicy(&policy);
+
+    int exitCode = 0;
+    if (path == NULL) {
+        repl();
     }
     else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        exitCode = runFile(path);
     }
 
+    if (dumpGCStats) {
+        printGCStats();
+    }
+    if (tableStatsEnabled) {
+        printTableStats();
+    }
     freeVM();
-    return 0;
+    return exitCode;
 }
\ No newline at end of file
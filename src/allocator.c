@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/allocator.h"
+#include "../include/object.h"
+
+/// @brief Offset of the first slot in a page, keeping slots aligned to the size-class granule.
+#define PAGE_HEADER_SIZE ((sizeof(Page) + SIZE_CLASS_GRANULE - 1) & ~(size_t)(SIZE_CLASS_GRANULE - 1))
+
+/// @returns The address of the given slot in a page.
+#define PAGE_SLOT(page, index) ((char*)(page) + PAGE_HEADER_SIZE + (size_t)(index) * (page)->slotSize)
+/// @returns The index of the slot that holds the given address.
+#define SLOT_INDEX(page, pointer) ((int)(((char*)(pointer) - (char*)(page) - PAGE_HEADER_SIZE) / (page)->slotSize))
+
+/// @returns The index of the lowest set bit in a non-zero word.
+static inline int lowestSetBit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#else
+    int index = 0;
+    while ((word & 1) == 0) {
+        word >>= 1;
+        ++index;
+    }
+    return index;
+#endif
+}
+
+/// @returns The mark bit of the given slot in a page.
+#define SLOT_MARK_INDEX(page, index) ((int)((PAGE_HEADER_SIZE + (size_t)(index) * (page)->slotSize) / SIZE_CLASS_GRANULE))
+
+/// @brief Allocates size bytes of page-aligned memory from the system.
+static Page* allocatePageMemory(size_t size) {
+#ifdef _WIN32
+    Page* page = (Page*)_aligned_malloc(size, PAGE_SIZE);
+#else
+    Page* page = (Page*)aligned_alloc(PAGE_SIZE, size);
+#endif
+    if (page == NULL) {
+        exit(1);
+    }
+    page->markBits = (uint64_t*)calloc(PAGE_BITMAP_WORDS, sizeof(uint64_t));
+    if (page->markBits == NULL) {
+        exit(1);
+    }
+    return page;
+}
+/// @brief Returns a page's memory to the system.
+static void freePageMemory(Page* page) {
+    free(page->markBits);
+#ifdef _WIN32
+    _aligned_free(page);
+#else
+    free(page);
+#endif
+}
+
+/// @brief Creates an empty page with the given slot layout.
+static Page* newPage(Heap* heap, size_t size, int sizeClass, size_t slotSize, int slotCount) {
+    Page* page = allocatePageMemory(size);
+    page->next = NULL;
+    page->sizeClass = sizeClass;
+    page->slotCount = slotCount;
+    page->slotSize = slotSize;
+    page->bumpIndex = 0;
+    page->liveCount = 0;
+    page->freeList = NULL;
+    memset(page->allocBits, 0, sizeof(page->allocBits));
+    page->evacuating = false;
+    ++heap->pageCount;
+    return page;
+}
+
+void initHeap(Heap* heap) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        heap->classes[i].pages = NULL;
+        heap->classes[i].tail = NULL;
+        heap->classes[i].current = NULL;
+    }
+    heap->largePages = NULL;
+    heap->pageCount = 0;
+}
+
+/// @brief Finalizes the allocated objects in a list of pages and frees the pages.
+static void freePages(Heap* heap, Page* page, FinalizeFn finalize) {
+    while (page != NULL) {
+        Page* next = page->next;
+        for (int word = 0; word < PAGE_BITMAP_WORDS; ++word) {
+            uint64_t bits = page->allocBits[word];
+            while (bits != 0) {
+                int index = word * 64 + lowestSetBit(bits);
+                bits &= bits - 1;
+                finalize((Obj*)PAGE_SLOT(page, index));
+            }
+        }
+        freePageMemory(page);
+        --heap->pageCount;
+        page = next;
+    }
+}
+
+void freeHeap(Heap* heap, FinalizeFn finalize) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        freePages(heap, heap->classes[i].pages, finalize);
+    }
+    freePages(heap, heap->largePages, finalize);
+    initHeap(heap);
+}
+
+/// @returns The index of the highest set bit in a non-zero word.
+static inline int highestSetBit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(word);
+#else
+    int index = 0;
+    while (word >>= 1) {
+        ++index;
+    }
+    return index;
+#endif
+}
+
+/// @returns The index of the smallest size class that fits the given size.
+static int sizeClassIndex(size_t size) {
+    if (size <= (size_t)SMALL_SIZE_CLASS_COUNT * SIZE_CLASS_GRANULE) {
+        return (int)((size - 1) / SIZE_CLASS_GRANULE);
+    }
+    // Each doubling above the small classes is split into four steps.
+    int bits = highestSetBit(size - 1);
+    int steps = (int)((size - 1) >> (bits - 2)) - 4;
+    return SMALL_SIZE_CLASS_COUNT + (bits - 8) * 4 + steps;
+}
+/// @returns The slot size of the given size class.
+static size_t sizeClassSlotSize(int index) {
+    if (index < SMALL_SIZE_CLASS_COUNT) {
+        return (size_t)(index + 1) * SIZE_CLASS_GRANULE;
+    }
+    int medium = index - SMALL_SIZE_CLASS_COUNT;
+    return (size_t)(5 + medium % 4) << (6 + medium / 4);
+}
+
+size_t heapAllocationSize(size_t size) {
+    if (size > SMALL_OBJECT_MAX) {
+        return (size + SIZE_CLASS_GRANULE - 1) & ~(size_t)(SIZE_CLASS_GRANULE - 1);
+    }
+    return sizeClassSlotSize(sizeClassIndex(size));
+}
+
+/// @brief Gives a large object a page of its own.
+static void* allocateLarge(Heap* heap, size_t size) {
+    size_t pageBytes = (PAGE_HEADER_SIZE + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    Page* page = newPage(heap, pageBytes, -1, heapAllocationSize(size), 1);
+    page->bumpIndex = 1;
+    page->liveCount = 1;
+    page->allocBits[0] = 1;
+
+    page->next = heap->largePages;
+    heap->largePages = page;
+    return PAGE_SLOT(page, 0);
+}
+
+/// @brief Adds an empty page to the end of a size class.
+static Page* appendPage(Heap* heap, int index) {
+    SizeClass* sizeClass = &heap->classes[index];
+    size_t slotSize = sizeClassSlotSize(index);
+    Page* page = newPage(heap, PAGE_SIZE, index, slotSize, (int)((PAGE_SIZE - PAGE_HEADER_SIZE) / slotSize));
+    if (sizeClass->tail != NULL) {
+        sizeClass->tail->next = page;
+    }
+    else {
+        sizeClass->pages = page;
+    }
+    sizeClass->tail = page;
+    return page;
+}
+
+/// @brief Takes a free slot from the given page.
+/// @returns The slot, or NULL if the page is full.
+static void* allocateFromPage(Page* page) {
+    void* slot;
+    if (page->freeList != NULL) {
+        slot = page->freeList;
+        page->freeList = *(void**)slot;
+    }
+    else if (page->bumpIndex < page->slotCount) {
+        slot = PAGE_SLOT(page, page->bumpIndex++);
+    }
+    else {
+        return NULL;
+    }
+
+    int index = SLOT_INDEX(page, slot);
+    page->allocBits[index / 64] |= (uint64_t)1 << (index % 64);
+    ++page->liveCount;
+    return slot;
+}
+
+void* heapAllocate(Heap* heap, size_t size) {
+    if (size > SMALL_OBJECT_MAX) {
+        return allocateLarge(heap, size);
+    }
+
+    int index = sizeClassIndex(size);
+    SizeClass* sizeClass = &heap->classes[index];
+
+    // Pages before the current one were full as of the last sweep.
+    for (Page* page = sizeClass->current; page != NULL; page = page->next) {
+        void* slot = allocateFromPage(page);
+        if (slot != NULL) {
+            sizeClass->current = page;
+            return slot;
+        }
+    }
+
+    Page* page = appendPage(heap, index);
+    sizeClass->current = page;
+    return allocateFromPage(page);
+}
+
+/// @brief Frees the unmarked objects in a page, putting their slots on the page's free list.
+/// @returns The number of bytes freed.
+static size_t sweepPage(Page* page, FinalizeFn finalize) {
+    size_t freed = 0;
+    for (int word = 0; word < PAGE_BITMAP_WORDS; ++word) {
+        uint64_t bits = page->allocBits[word];
+        while (bits != 0) {
+            int index = word * 64 + lowestSetBit(bits);
+            bits &= bits - 1;
+
+            int markIndex = SLOT_MARK_INDEX(page, index);
+            if ((page->markBits[markIndex / 64] >> (markIndex % 64)) & 1) {
+                continue;
+            }
+
+            Obj* object = (Obj*)PAGE_SLOT(page, index);
+            finalize(object);
+            page->allocBits[word] &= ~((uint64_t)1 << (index % 64));
+            *(void**)object = page->freeList;
+            page->freeList = object;
+            --page->liveCount;
+            freed += page->slotSize;
+        }
+    }
+
+    // Only the side bitmap is written for the survivors.
+    memset(page->markBits, 0, PAGE_BITMAP_WORDS * sizeof(uint64_t));
+    return freed;
+}
+
+size_t sweepHeap(Heap* heap, FinalizeFn finalize) {
+    size_t freed = 0;
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        SizeClass* sizeClass = &heap->classes[i];
+        Page* previous = NULL;
+        Page* page = sizeClass->pages;
+        bool keptEmptyPage = false;
+
+        while (page != NULL) {
+            Page* next = page->next;
+            freed += sweepPage(page, finalize);
+
+            // Keep one empty page per class around so that a steady allocation rate doesn't thrash the system allocator.
+            if (page->liveCount == 0 && keptEmptyPage) {
+                if (previous != NULL) {
+                    previous->next = next;
+                }
+                else {
+                    sizeClass->pages = next;
+                }
+                freePageMemory(page);
+                --heap->pageCount;
+            }
+            else {
+                if (page->liveCount == 0) {
+                    keptEmptyPage = true;
+                }
+                previous = page;
+            }
+            page = next;
+        }
+
+        sizeClass->tail = previous;
+        sizeClass->current = sizeClass->pages;
+    }
+
+    Page* previous = NULL;
+    Page* page = heap->largePages;
+    while (page != NULL) {
+        Page* next = page->next;
+        Obj* object = (Obj*)PAGE_SLOT(page, 0);
+        if (isMarked(object)) {
+            memset(page->markBits, 0, PAGE_BITMAP_WORDS * sizeof(uint64_t));
+            previous = page;
+        }
+        else {
+            finalize(object);
+            freed += page->slotSize;
+            if (previous != NULL) {
+                previous->next = next;
+            }
+            else {
+                heap->largePages = next;
+            }
+            freePageMemory(page);
+            --heap->pageCount;
+        }
+        page = next;
+    }
+
+    return freed;
+}
+
+int heapOccupiedPageCount(Heap* heap) {
+    int count = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        for (Page* page = heap->classes[i].pages; page != NULL; page = page->next) {
+            if (page->liveCount > 0) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+double heapFragmentation(Heap* heap) {
+    size_t capacity = 0;
+    size_t live = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        for (Page* page = heap->classes[i].pages; page != NULL; page = page->next) {
+            // Empty pages are free memory, not fragmentation.
+            if (page->liveCount > 0) {
+                capacity += (size_t)page->slotCount;
+                live += (size_t)page->liveCount;
+            }
+        }
+    }
+    return capacity == 0 ? 0.0 : 1.0 - (double)live / (double)capacity;
+}
+
+int evacuateHeap(Heap* heap, double occupancyThreshold) {
+    int moved = 0;
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        SizeClass* sizeClass = &heap->classes[i];
+        for (Page* page = sizeClass->pages; page != NULL; page = page->next) {
+            page->evacuating = page->liveCount > 0 && page->liveCount < page->slotCount * occupancyThreshold;
+        }
+
+        // Survivors are packed into the pages that stay, then into fresh pages at the end of the class.
+        Page* target = sizeClass->pages;
+        for (Page* page = sizeClass->pages; page != NULL; page = page->next) {
+            if (!page->evacuating) {
+                continue;
+            }
+
+            for (int word = 0; word < PAGE_BITMAP_WORDS; ++word) {
+                uint64_t bits = page->allocBits[word];
+                while (bits != 0) {
+                    int index = word * 64 + lowestSetBit(bits);
+                    bits &= bits - 1;
+
+                    void* slot = NULL;
+                    while (slot == NULL) {
+                        if (target == NULL) {
+                            target = appendPage(heap, i);
+                        }
+                        if (!target->evacuating) {
+                            slot = allocateFromPage(target);
+                        }
+                        if (slot == NULL) {
+                            target = target->next;
+                        }
+                    }
+
+                    Obj* object = (Obj*)PAGE_SLOT(page, index);
+                    memcpy(slot, object, page->slotSize);
+                    *(Obj**)object = (Obj*)slot;
+                    ++moved;
+                }
+            }
+        }
+    }
+
+    return moved;
+}
+
+void walkHeap(Heap* heap, VisitFn visit) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        for (Page* page = heap->classes[i].pages; page != NULL; page = page->next) {
+            if (page->evacuating) {
+                continue;
+            }
+            for (int word = 0; word < PAGE_BITMAP_WORDS; ++word) {
+                uint64_t bits = page->allocBits[word];
+                while (bits != 0) {
+                    int index = word * 64 + lowestSetBit(bits);
+                    bits &= bits - 1;
+                    visit((Obj*)PAGE_SLOT(page, index));
+                }
+            }
+        }
+    }
+    for (Page* page = heap->largePages; page != NULL; page = page->next) {
+        visit((Obj*)PAGE_SLOT(page, 0));
+    }
+}
+
+void releaseEvacuatedPages(Heap* heap) {
+    for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+        SizeClass* sizeClass = &heap->classes[i];
+        Page* previous = NULL;
+        Page* page = sizeClass->pages;
+        while (page != NULL) {
+            Page* next = page->next;
+            if (page->evacuating) {
+                if (previous != NULL) {
+                    previous->next = next;
+                }
+                else {
+                    sizeClass->pages = next;
+                }
+                freePageMemory(page);
+                --heap->pageCount;
+            }
+            else {
+                previous = page;
+            }
+            page = next;
+        }
+        sizeClass->tail = previous;
+        sizeClass->current = sizeClass->pages;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,314 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/bulk.h"
+#include "../include/kernels.h"
+#include "../include/memory.h"
+#include "../include/pool.h"
+
+size_t parallelMinElements = 4 * BULK_CHUNK_ELEMENTS;
+
+/// @brief The operands of a bulk operation, shared by all of its chunks.
+typedef struct {
+    double* y;
+    const double* x;
+    size_t n;
+    double scalar;
+    BulkOp op;
+    // One result per chunk, for reductions and the first pass of prefix sums.
+    double* partials;
+} BulkJob;
+
+/// @returns The number of chunks an array of n elements is split into.
+static int chunkCount(size_t n) {
+    return (int)((n + BULK_CHUNK_ELEMENTS - 1) / BULK_CHUNK_ELEMENTS);
+}
+
+/// @returns The index of a chunk's first element, and puts its number of elements in count.
+static size_t chunkStart(size_t n, int chunk, size_t* count) {
+    size_t start = (size_t)chunk * BULK_CHUNK_ELEMENTS;
+    *count = n - start < BULK_CHUNK_ELEMENTS ? n - start : BULK_CHUNK_ELEMENTS;
+    return start;
+}
+
+/// @brief Runs a job's chunks, in parallel if the array is long enough.
+static void runJob(BulkJob* job, ChunkFn fn) {
+    runChunks(fn, job, chunkCount(job->n), job->n >= parallelMinElements);
+}
+
+static void sumChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    job->partials[chunk] = float64Kernels.sum(job->x + start, count);
+}
+
+static void dotChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    job->partials[chunk] = float64Kernels.dot(job->x + start, job->y + start, count);
+}
+
+static void minChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    job->partials[chunk] = float64Kernels.min(job->x + start, count);
+}
+
+static void maxChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    job->partials[chunk] = float64Kernels.max(job->x + start, count);
+}
+
+typedef enum Combine {
+    COMBINE_ADD,
+    COMBINE_MIN,
+    COMBINE_MAX,
+} Combine;
+
+/// @brief Runs a reduction and folds the results of its chunks in chunk order, which doesn't depend on which thread ran
+/// them.
+static double reduce(BulkJob* job, ChunkFn fn, Combine combine) {
+    int chunks = chunkCount(job->n);
+    double single;
+    job->partials = chunks == 1 ? &single : ALLOCATE(double, chunks);
+    runJob(job, fn);
+
+    double total = job->partials[0];
+    for (int chunk = 1; chunk < chunks; ++chunk) {
+        double partial = job->partials[chunk];
+        switch (combine) {
+            case COMBINE_ADD:
+                total += partial;
+                break;
+            // A chunk holding a NaN returns NaN, which then wins like it does within the kernels.
+            case COMBINE_MIN:
+                total = partial < total || isnan(partial) ? partial : total;
+                break;
+            case COMBINE_MAX:
+                total = partial > total || isnan(partial) ? partial : total;
+                break;
+        }
+    }
+    if (chunks > 1) {
+        FREE_ARRAY(double, job->partials, chunks);
+    }
+    return total;
+}
+
+double bulkSum(const double* x, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    BulkJob job = {.x = x, .n = n};
+    return reduce(&job, sumChunk, COMBINE_ADD);
+}
+
+double bulkDot(const double* x, const double* y, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    BulkJob job = {.x = x, .y = (double*)y, .n = n};
+    return reduce(&job, dotChunk, COMBINE_ADD);
+}
+
+double bulkMin(const double* x, size_t n) {
+    BulkJob job = {.x = x, .n = n};
+    return reduce(&job, minChunk, COMBINE_MIN);
+}
+
+double bulkMax(const double* x, size_t n) {
+    BulkJob job = {.x = x, .n = n};
+    return reduce(&job, maxChunk, COMBINE_MAX);
+}
+
+static void scaleChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    float64Kernels.scale(job->y + start, count, job->scalar);
+}
+
+void bulkScale(double* x, size_t n, double factor) {
+    BulkJob job = {.y = x, .n = n, .scalar = factor};
+    runJob(&job, scaleChunk);
+}
+
+static void axpyChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    float64Kernels.axpy(job->y + start, job->x + start, count, job->scalar);
+}
+
+void bulkAxpy(double* y, const double* x, size_t n, double alpha) {
+    BulkJob job = {.y = y, .x = x, .n = n, .scalar = alpha};
+    runJob(&job, axpyChunk);
+}
+
+static void elementwiseChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    double* y = job->y + start;
+    const double* x = job->x + start;
+    switch (job->op) {
+        case BULK_ADD:
+            float64Kernels.add(y, x, count);
+            break;
+        case BULK_SUB:
+            float64Kernels.sub(y, x, count);
+            break;
+        case BULK_MUL:
+            float64Kernels.mul(y, x, count);
+            break;
+        case BULK_DIV:
+            float64Kernels.div(y, x, count);
+            break;
+    }
+}
+
+void bulkElementwise(BulkOp op, double* y, const double* x, size_t n) {
+    BulkJob job = {.y = y, .x = x, .n = n, .op = op};
+    runJob(&job, elementwiseChunk);
+}
+
+/// @brief Puts a chunk's own prefix sum, starting from 0, in its partial. The chunk itself is left alone.
+static void chunkTotalChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    // Same pairing as the prefix sum kernels, so a single chunk gives the last element its scan would.
+    const double* x = job->x + start;
+    double carry = 0;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        carry = carry + (x[i] + x[i + 1]);
+    }
+    if (i < count) {
+        carry = carry + x[i];
+    }
+    job->partials[chunk] = carry;
+}
+
+/// @brief Scans a chunk starting from the carry in its partial.
+static void prefixSumChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    float64Kernels.prefixSum(job->y + start, count, job->partials[chunk]);
+}
+
+void bulkPrefixSum(double* x, size_t n) {
+    int chunks = chunkCount(n);
+    if (chunks <= 1) {
+        float64Kernels.prefixSum(x, n, 0);
+        return;
+    }
+
+    // The first pass finds each chunk's total, the carries into the chunks are summed in order on this thread, and the second
+    // pass scans every chunk from its carry.
+    BulkJob job = {.y = x, .x = x, .n = n};
+    job.partials = ALLOCATE(double, chunks);
+    runJob(&job, chunkTotalChunk);
+    double carry = 0;
+    for (int chunk = 0; chunk < chunks; ++chunk) {
+        double total = job.partials[chunk];
+        job.partials[chunk] = carry;
+        carry = carry + total;
+    }
+    runJob(&job, prefixSumChunk);
+    FREE_ARRAY(double, job.partials, chunks);
+}
+
+/// @returns Whether a sorts before b: ascending, -0 before 0, and NaNs last.
+static inline bool sortsBefore(double a, double b) {
+    if (a < b) {
+        return true;
+    }
+    if (a == b) {
+        return signbit(a) && !signbit(b);
+    }
+    // Unordered, so at least one is NaN.
+    return !isnan(a) && isnan(b);
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    if (sortsBefore(left, right)) {
+        return -1;
+    }
+    if (sortsBefore(right, left)) {
+        return 1;
+    }
+    return 0;
+}
+
+static void sortChunk(void* context, int chunk) {
+    BulkJob* job = (BulkJob*)context;
+    size_t count;
+    size_t start = chunkStart(job->n, chunk, &count);
+    qsort(job->y + start, count, sizeof(double), compareDoubles);
+}
+
+/// @brief A round of merging sorted runs of width elements from x into y, two runs per chunk.
+typedef struct {
+    const double* from;
+    double* to;
+    size_t n;
+    size_t width;
+} MergeRound;
+
+static void mergeChunk(void* context, int chunk) {
+    MergeRound* round = (MergeRound*)context;
+    size_t low = (size_t)chunk * 2 * round->width;
+    size_t middle = low + round->width < round->n ? low + round->width : round->n;
+    size_t high = middle + round->width < round->n ? middle + round->width : round->n;
+
+    size_t left = low;
+    size_t right = middle;
+    size_t out = low;
+    while (left < middle && right < high) {
+        // Taking from the left run on ties keeps the merge stable.
+        if (sortsBefore(round->from[right], round->from[left])) {
+            round->to[out++] = round->from[right++];
+        }
+        else {
+            round->to[out++] = round->from[left++];
+        }
+    }
+    memcpy(round->to + out, round->from + left, (middle - left) * sizeof(double));
+    out += middle - left;
+    memcpy(round->to + out, round->from + right, (high - right) * sizeof(double));
+}
+
+void bulkSort(double* x, size_t n) {
+    int chunks = chunkCount(n);
+    BulkJob job = {.y = x, .n = n};
+    runJob(&job, sortChunk);
+    if (chunks <= 1) {
+        return;
+    }
+
+    // Merge the sorted chunks pairwise, back and forth between the array and a buffer, until one run is left.
+    double* buffer = ALLOCATE(double, n);
+    MergeRound round = {.from = x, .to = buffer, .n = n};
+    bool parallel = n >= parallelMinElements;
+    for (round.width = BULK_CHUNK_ELEMENTS; round.width < n; round.width *= 2) {
+        int merges = (int)((n + 2 * round.width - 1) / (2 * round.width));
+        runChunks(mergeChunk, &round, merges, parallel);
+        double* merged = round.to;
+        round.to = (double*)round.from;
+        round.from = merged;
+    }
+    if (round.from != x) {
+        memcpy(x, round.from, n * sizeof(double));
+    }
+    FREE_ARRAY(double, buffer, n);
+}
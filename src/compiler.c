@@ -7,6 +7,7 @@
 #include "../include/memory.h"
 #include "../include/object.h"
 #include "../include/scanner.h"
+#include "../include/vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "../include/debug.h"
@@ -17,6 +18,8 @@ typedef struct {
     Token previous;
     bool hadError;
     bool panicMode;
+    // The source being compiled, which owns the characters of the tokens.
+    ObjString* source;
 } Parser;
 
 typedef enum {
@@ -49,10 +52,13 @@ typedef struct {
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
+// Index operands take two bytes behind OP_WIDE, so a function can have this many constants, locals and upvalues.
+#define INDEX_COUNT (UINT16_MAX + 1)
+
 typedef enum FunctionType {
     TYPE_FUNCTION,
     TYPE_INITIALIZER,
@@ -60,16 +66,70 @@ typedef enum FunctionType {
     TYPE_SCRIPT,
 } FunctionType;
 
+/// @brief Forward jumps waiting for their target, by the chunk offset of their operand.
+typedef struct {
+    int count;
+    int capacity;
+    int* offsets;
+} JumpList;
+
+/// @brief The condition of an if statement or a loop. Its outermost 'and' and 'or' operands branch straight to where the
+/// condition is decided, instead of leaving values on the stack for the next operand to test.
+typedef struct {
+    // The expression depth of the condition's outermost operands.
+    int depth;
+    // Branches taken by a true operand before an 'or', which decides the condition.
+    JumpList trueJumps;
+    // Branches taken by a false operand of the current run of 'and's, which moves on to the operand after the next 'or', or
+    // decides the condition if there is none.
+    JumpList falseJumps;
+} Condition;
+
+/// @brief Finds the constants a function already has, so that each value is added to its chunk once. Values are matched
+/// by identity: strings are interned, so a name used twice is the same object, and numbers are matched by their bits.
+typedef struct {
+    int capacity;
+    // Each slot holds the index of a constant in the chunk, or -1 if it is empty.
+    int* slots;
+} ConstantIndex;
+
+/// @brief Code cut out of a chunk to be appended again later, like a loop condition that is tested after the body.
+typedef struct {
+    int count;
+    uint8_t* code;
+    int* lines;
+} CodeFragment;
+
 typedef struct Compiler {
     struct Compiler* enclosing;
 
     ObjFunction* function;
     FunctionType type;
+    ConstantIndex constants;
 
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCapacity;
     int scopeDepth;
+
+    // Where the instructions of the last comparison start and end, and the branch that tests the same thing, so that a
+    // branch right after the comparison can replace it.
+    int comparisonStart;
+    int comparisonEnd;
+    uint8_t comparisonBranch;
+    // Where the last '!' ends, so that a branch right after it can test the operand the other way instead.
+    int notEnd;
+    // Where the last OP_INT and 'nil' end, so that an instruction right after them can take the value as an operand.
+    int intEnd;
+    int nilEnd;
+    // The last offset a forward jump was patched to. Jumps landing there expect the value before it on the stack, so the
+    // instruction that computed it can't be folded into a branch.
+    int lastLabel;
+    // How many parsePrecedence calls are running, and the condition being compiled, if any.
+    int expressionDepth;
+    Condition* condition;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -157,6 +217,20 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte1);
     emitByte(byte2);
 }
+/// @brief Appends a two-byte operand to the current chunk.
+static void emitShort(uint16_t value) {
+    emitBytes((value >> 8) & 0xff, value & 0xff);
+}
+/// @brief Appends an instruction with a constant or local index operand, behind OP_WIDE if the index doesn't fit in a byte.
+static void emitIndexed(uint8_t instruction, int index) {
+    if (index > UINT8_MAX) {
+        emitBytes(OP_WIDE, instruction);
+        emitShort((uint16_t)index);
+    }
+    else {
+        emitBytes(instruction, (uint8_t)index);
+    }
+}
 /// @brief Emits an instruction to jump back to the given offset.
 static int emitLoop(int loopStart) {
     emitByte(OP_LOOP);
@@ -181,25 +255,82 @@ static void emitReturn() {
         emitBytes(OP_GET_LOCAL, 0);
     }
     else {
-        emitByte(OP_NIL);
+        emitByte(OP_RETURN_NIL);
+        return;
     }
     emitByte(OP_RETURN);
 }
 
-/// @brief Adds a constant to the VM's constant table and checks for overflow.
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+/// @returns The slot of a value in the constant index: the one holding it, or the empty one to add it in.
+static int* findConstantSlot(ConstantIndex* index, Value value) {
+    Value* constants = currentChunk()->constants.values;
+    uint32_t mask = (uint32_t)index->capacity - 1;
+    uint32_t i = hashValueIdentity(value) & mask;
+    while (true) {
+        int* slot = &index->slots[i];
+        if (*slot == -1 || valuesIdentical(constants[*slot], value)) {
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+}
+/// @brief Grows the constant index and adds every constant of the current chunk to it again.
+static void growConstantIndex(ConstantIndex* index) {
+    FREE_ARRAY(int, index->slots, index->capacity);
+    index->capacity = GROW_CAPACITY(index->capacity);
+    index->slots = ALLOCATE(int, index->capacity);
+    for (int i = 0; i < index->capacity; ++i) {
+        index->slots[i] = -1;
+    }
 
-    if (constant > UINT8_MAX) {
+    ValueArray* constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count; ++i) {
+        *findConstantSlot(index, constants->values[i]) = i;
+    }
+}
+
+/// @brief Adds a constant to the VM's constant table and checks for overflow. A value the chunk already has isn't added
+/// again.
+static int makeConstant(Value value) {
+    ConstantIndex* index = &current->constants;
+    int* slot = NULL;
+    if (index->capacity > 0) {
+        slot = findConstantSlot(index, value);
+        if (*slot != -1) {
+            return *slot;
+        }
+    }
+
+    int constant = addConstant(currentChunk(), value);
+    if (constant >= INDEX_COUNT) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    // The index is grown once the value is in the chunk, where the GC can reach it.
+    if (constant + 1 > index->capacity * 3 / 4) {
+        growConstantIndex(index);
+    }
+    else {
+        *slot = constant;
+    }
+    return constant;
 }
 /// @brief Appends a constant to the current chunk.
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, makeConstant(value));
+}
+
+/// @brief Appends an instruction that pushes a small integer.
+static void emitInt(int16_t value) {
+    emitByte(OP_INT);
+    emitShort((uint16_t)value);
+    current->intEnd = currentChunk()->count;
+}
+/// @returns The operand of the OP_INT that ends at the current offset.
+static int16_t lastInt() {
+    uint8_t* operand = currentChunk()->code + currentChunk()->count - 2;
+    return (int16_t)((operand[0] << 8) | operand[1]);
 }
 
 /// @brief Fixes the actual jump offset in the instructions.
@@ -213,6 +344,109 @@ static void patchJump(int offset) {
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    current->lastLabel = currentChunk()->count;
+}
+
+/// @brief Initializes an empty jump list.
+static void initJumpList(JumpList* list) {
+    list->count = 0;
+    list->capacity = 0;
+    list->offsets = NULL;
+}
+/// @brief Adds a jump, by the offset of its operand, to a list.
+static void addJump(JumpList* list, int offset) {
+    if (list->count == list->capacity) {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->offsets = GROW_ARRAY(int, list->offsets, oldCapacity, list->capacity);
+    }
+    list->offsets[list->count++] = offset;
+}
+/// @brief Points every jump in a list at the current offset and empties the list.
+static void patchJumps(JumpList* list) {
+    for (int i = 0; i < list->count; ++i) {
+        patchJump(list->offsets[i]);
+    }
+    FREE_ARRAY(int, list->offsets, list->capacity);
+    initJumpList(list);
+}
+
+/// @brief Remembers the comparison that was just emitted, starting at the given offset.
+/// @param branch The forward branch that pops the operands and jumps if the comparison holds.
+static void markComparison(int start, uint8_t branch) {
+    current->comparisonStart = start;
+    current->comparisonEnd = currentChunk()->count;
+    current->comparisonBranch = branch;
+}
+/// @returns Whether the instruction that ends at the current offset can be folded into a branch after it.
+static bool canFoldLast(int end) {
+    return end == currentChunk()->count && current->lastLabel != end;
+}
+/// @brief Emits a forward branch that pops the value on top of the stack and jumps if it is truthy, or if it is falsey
+/// when when is false. A comparison or '!' that computed the value is folded into the branch.
+/// @returns Chunk offset of the branch's jump operand.
+static int emitBranch(bool when) {
+    if (canFoldLast(current->notEnd)) {
+        // Branching on !x is branching on x the other way.
+        --currentChunk()->count;
+        current->notEnd = -1;
+        when = !when;
+    }
+    if (canFoldLast(current->comparisonEnd)) {
+        currentChunk()->count = current->comparisonStart;
+        current->comparisonEnd = -1;
+        current->nilEnd = -1;
+        uint8_t branch = current->comparisonBranch;
+        if (!when) {
+            branch = OP_JUMP_IF_LESS + ((branch - OP_JUMP_IF_LESS) ^ 1);
+        }
+        return emitJump(branch);
+    }
+    return emitJump(when ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE);
+}
+
+/// @brief Moves the code from the given offset to the end of the chunk into a fragment.
+static void cutCode(int start, CodeFragment* fragment) {
+    Chunk* chunk = currentChunk();
+    int count = chunk->count - start;
+    fragment->count = count;
+    fragment->code = ALLOCATE(uint8_t, count);
+    fragment->lines = ALLOCATE(int, count);
+    memcpy(fragment->code, chunk->code + start, count);
+    memcpy(fragment->lines, chunk->lines + start, sizeof(int) * count);
+    chunk->count = start;
+    // Whatever was emitted last is gone.
+    current->comparisonEnd = -1;
+    current->notEnd = -1;
+    current->intEnd = -1;
+    current->nilEnd = -1;
+}
+/// @brief Appends the code of a fragment to the chunk and frees the fragment. Jumps within the fragment are relative, so they
+/// still land on the same instructions.
+static void pasteCode(CodeFragment* fragment) {
+    for (int i = 0; i < fragment->count; ++i) {
+        writeChunk(currentChunk(), fragment->code[i], fragment->lines[i]);
+    }
+    FREE_ARRAY(uint8_t, fragment->code, fragment->count);
+    FREE_ARRAY(int, fragment->lines, fragment->count);
+    fragment->count = 0;
+    fragment->code = NULL;
+    fragment->lines = NULL;
+    current->comparisonEnd = -1;
+    current->notEnd = -1;
+    current->intEnd = -1;
+    current->nilEnd = -1;
+}
+
+/// @brief Takes the next slot in the current compiler's locals, growing the array if it is full.
+/// @returns The uninitialized local.
+static Local* pushLocal() {
+    if (current->localCount == current->localCapacity) {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+    }
+    return &current->locals[current->localCount++];
 }
 
 /// @brief Initializes the compiler.
@@ -220,16 +454,29 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->constants.capacity = 0;
+    compiler->constants.slots = NULL;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->comparisonEnd = -1;
+    compiler->notEnd = -1;
+    compiler->intEnd = -1;
+    compiler->nilEnd = -1;
+    compiler->lastLabel = -1;
+    compiler->expressionDepth = 0;
+    compiler->condition = NULL;
     compiler->function = newFunction();
     current = compiler;
 
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        current->function->name = sliceString(parser.source, parser.previous.start, parser.previous.length);
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal();
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION) {
@@ -242,17 +489,247 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+/// @brief Records the stack depth at an offset the first time control is found to reach it, and queues the offset to be
+/// walked from.
+static void reachOffset(int* depths, int* pending, int* pendingCount, int offset, int depth) {
+    if (depths[offset] == -1) {
+        depths[offset] = depth;
+        pending[(*pendingCount)++] = offset;
+    }
+}
+
+/// @brief Follows every path through the chunk's instructions to find how deep its frame's stack gets.
+/// @returns The most values on the stack at once, starting from the callee and its arguments.
+static int stackSize(Chunk* chunk, int entryDepth) {
+    int* depths = ALLOCATE(int, chunk->count);
+    int* pending = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; ++i) {
+        depths[i] = -1;
+    }
+    int pendingCount = 0;
+    int maxDepth = entryDepth;
+    reachOffset(depths, pending, &pendingCount, 0, entryDepth);
+
+    while (pendingCount > 0) {
+        int offset = pending[--pendingCount];
+        int depth = depths[offset];
+        uint8_t* code = chunk->code + offset;
+        bool wide = code[0] == OP_WIDE;
+        if (wide) {
+            ++code;
+        }
+        int length = wide ? 4 : 2;
+        // The change in depth when the instruction falls through to the next one and when it branches.
+        int effect = 0;
+        int branchEffect = 0;
+        int target = -1;
+        bool fallsThrough = true;
+
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL:
+            case OP_GET_UPVALUE:
+            case OP_CLASS:
+                effect = 1;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_GLOBAL:
+            case OP_SET_UPVALUE:
+            case OP_GET_PROPERTY:
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_PROPERTY:
+                effect = -1;
+                break;
+            case OP_CLOSURE: {
+                int index = wide ? (code[1] << 8) | code[2] : code[1];
+                effect = 1;
+                length += 3 * AS_FUNCTION(chunk->constants.values[index])->upvalueCount;
+                break;
+            }
+            case OP_INT:
+                effect = 1;
+                length = 3;
+                break;
+            case OP_ADD_INT:
+            case OP_SUBTRACT_INT:
+                length = 3;
+                break;
+            case OP_GET_SUPER:
+            case OP_METHOD:
+                effect = -1;
+                length = 3;
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                effect = 1;
+                length = 1;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                length = 1;
+                break;
+            case OP_POP:
+            case OP_INDEX_GET:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_PRINT:
+            case OP_CLOSE_UPVALUE:
+            case OP_INHERIT:
+                effect = -1;
+                length = 1;
+                break;
+            case OP_INDEX_SET:
+                effect = -2;
+                length = 1;
+                break;
+            case OP_JUMP:
+                fallsThrough = false;
+                length = 3;
+                target = offset + length + ((code[1] << 8) | code[2]);
+                break;
+            case OP_LOOP:
+                fallsThrough = false;
+                length = 3;
+                target = offset + length - ((code[1] << 8) | code[2]);
+                break;
+            case OP_JUMP_IF_FALSE_OR_POP:
+            case OP_JUMP_IF_TRUE_OR_POP:
+                effect = -1;
+                length = 3;
+                target = offset + length + ((code[1] << 8) | code[2]);
+                break;
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_TRUE:
+            case OP_JUMP_IF_NIL:
+            case OP_JUMP_IF_NOT_NIL:
+                effect = branchEffect = -1;
+                length = 3;
+                target = offset + length + ((code[1] << 8) | code[2]);
+                break;
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_EQUAL:
+            case OP_JUMP_IF_NOT_EQUAL:
+                effect = branchEffect = -2;
+                length = 3;
+                target = offset + length + ((code[1] << 8) | code[2]);
+                break;
+            case OP_POP_LOOP_IF_FALSE:
+            case OP_POP_LOOP_IF_TRUE:
+            case OP_LOOP_IF_NIL:
+            case OP_LOOP_IF_NOT_NIL:
+                effect = branchEffect = -1;
+                length = 3;
+                target = offset + length - ((code[1] << 8) | code[2]);
+                break;
+            case OP_LOOP_IF_LESS:
+            case OP_LOOP_IF_NOT_LESS:
+            case OP_LOOP_IF_GREATER:
+            case OP_LOOP_IF_NOT_GREATER:
+            case OP_LOOP_IF_EQUAL:
+            case OP_LOOP_IF_NOT_EQUAL:
+                effect = branchEffect = -2;
+                length = 3;
+                target = offset + length - ((code[1] << 8) | code[2]);
+                break;
+            case OP_FOR_RANGE_ENTER:
+                // Pushes the loop variable either way.
+                effect = branchEffect = 1;
+                length = 5;
+                target = offset + length + ((code[3] << 8) | code[4]);
+                break;
+            case OP_FOR_RANGE:
+                length = 5;
+                target = offset + length - ((code[3] << 8) | code[4]);
+                break;
+            case OP_CALL:
+                effect = -code[1];
+                break;
+            case OP_INVOKE:
+                effect = -code[3];
+                length = 4;
+                break;
+            case OP_SUPER_INVOKE:
+                effect = -code[3] - 1;
+                length = 4;
+                break;
+            case OP_RETURN:
+                fallsThrough = false;
+                break;
+            case OP_RETURN_NIL:
+                // Pushes the nil it returns.
+                effect = 1;
+                fallsThrough = false;
+                break;
+            case OP_BUILD_LIST:
+                effect = 1 - code[1];
+                break;
+            case OP_EXTEND_LIST:
+                effect = -code[1];
+                break;
+            case OP_BUILD_MAP:
+                // The map is pushed above its pairs while they are added.
+                maxDepth = depth + 1 > maxDepth ? depth + 1 : maxDepth;
+                effect = 1 - 2 * code[1];
+                break;
+            case OP_EXTEND_MAP:
+                effect = -2 * code[1];
+                break;
+        }
+
+        if (depth + effect > maxDepth) {
+            maxDepth = depth + effect;
+        }
+        if (fallsThrough) {
+            reachOffset(depths, pending, &pendingCount, offset + length, depth + effect);
+        }
+        if (target != -1) {
+            if (depth + branchEffect > maxDepth) {
+                maxDepth = depth + branchEffect;
+            }
+            reachOffset(depths, pending, &pendingCount, target, depth + branchEffect);
+        }
+    }
+
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(int, pending, chunk->count);
+    return maxDepth;
+}
+
 /// @brief Ends compilation.
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    if (!parser.hadError) {
+        function->stackSize = stackSize(currentChunk(), function->arity + 1);
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        // Names may be slices of the source, which aren't null-terminated.
+        char name[UINT8_COUNT];
+        if (function->name != NULL) {
+            snprintf(name, sizeof(name), "%.*s", function->name->length, stringChars(function->name));
+        }
+        else {
+            snprintf(name, sizeof(name), "<script>");
+        }
+        disassembleChunk(currentChunk(), name);
     }
 #endif
 
+    FREE_ARRAY(int, current->constants.slots, current->constants.capacity);
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
     current = current->enclosing;
     return function;
 }
@@ -287,10 +764,86 @@ static void declaration();
 /// @brief Parses a statement.
 static void statement();
 
+/// @brief Starts compiling a condition, whose outermost 'and' and 'or' operands branch instead of producing values.
+static void beginCondition(Condition* condition) {
+    condition->depth = current->expressionDepth + 1;
+    initJumpList(&condition->trueJumps);
+    initJumpList(&condition->falseJumps);
+    current->condition = condition;
+}
+/// @returns The condition whose outermost operands are being parsed, or NULL if there is none.
+static Condition* outermostCondition() {
+    Condition* condition = current->condition;
+    return condition != NULL && condition->depth == current->expressionDepth ? condition : NULL;
+}
+/// @brief Ends a condition with a branch on its last operand that is taken if the condition is true, or false when when is
+/// false. The branches that decide the condition the other way are pointed after it.
+/// @param jumps Receives the branches taken when the condition is when.
+static void endCondition(Condition* condition, bool when, JumpList* jumps) {
+    current->condition = NULL;
+    if (when) {
+        addJump(&condition->trueJumps, emitBranch(true));
+        patchJumps(&condition->falseJumps);
+        *jumps = condition->trueJumps;
+    }
+    else {
+        addJump(&condition->falseJumps, emitBranch(false));
+        patchJumps(&condition->trueJumps);
+        *jumps = condition->falseJumps;
+    }
+}
+
+/// @brief Parses a loop condition followed by the given token, with branches back to the body while it holds, and cuts it
+/// out of the chunk so that it can be tested after the body.
+/// @param loopJumps Receives the branches back to the body, by their offset in the fragment.
+static void loopCondition(CodeFragment* fragment, JumpList* loopJumps, TokenType terminator, const char* message) {
+    int start = currentChunk()->count;
+    Condition condition;
+    beginCondition(&condition);
+    expression();
+    consume(terminator, message);
+    endCondition(&condition, true, loopJumps);
+
+    cutCode(start, fragment);
+    for (int i = 0; i < loopJumps->count; ++i) {
+        loopJumps->offsets[i] -= start;
+    }
+}
+/// @brief Appends a loop condition cut out by loopCondition, turning its branches into backward ones to the given body
+/// start.
+static void emitLoopCondition(CodeFragment* fragment, JumpList* loopJumps, int bodyStart) {
+    int base = currentChunk()->count;
+    pasteCode(fragment);
+
+    uint8_t* code = currentChunk()->code;
+    for (int i = 0; i < loopJumps->count; ++i) {
+        int operand = base + loopJumps->offsets[i];
+        code[operand - 1] += OP_POP_LOOP_IF_FALSE - OP_POP_JUMP_IF_FALSE;
+
+        int offset = operand + 2 - bodyStart;
+        if (offset > UINT16_MAX) {
+            error("Loop body too large.");
+        }
+        code[operand] = (offset >> 8) & 0xff;
+        code[operand + 1] = offset & 0xff;
+    }
+    FREE_ARRAY(int, loopJumps->offsets, loopJumps->capacity);
+    initJumpList(loopJumps);
+}
+
 /// @brief Puts an identifier into the VM's constant table.
 /// @returns The index of the constant in the constant table.
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifierConstant(Token* name) {
+    return makeConstant(OBJ_VAL(sliceString(parser.source, name->start, name->length)));
+}
+
+/// @brief Appends the selector of a method name to the current chunk as a two-byte operand.
+static void emitSelector(Token* name) {
+    int selector = selectorFor(copyString(name->start, name->length));
+    if (selector >= SELECTOR_MAX) {
+        error("Too many method names.");
+    }
+    emitBytes((selector >> 8) & 0xff, selector & 0xff);
 }
 
 /// @returns Whether the two given identifiers are equal.
@@ -314,7 +867,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 
 /// @brief Adds an upvalue to the compiler's upvalue array.
 /// @returns The index of the created upvalue in the compiler's upvalue array.
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, uint16_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; ++i) {
@@ -324,10 +877,15 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == INDEX_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
+    if (upvalueCount == compiler->upvalueCapacity) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
@@ -343,12 +901,12 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, (uint16_t)local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
@@ -356,12 +914,12 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 
 /// @brief Adds a local variable to the compiler's stack.
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == INDEX_COUNT) {
         error("Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal();
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -389,7 +947,7 @@ static void declareVariable() {
 }
 /// @brief Parses a variable identifier and creates a constant for the name.
 /// @returns The index of the variable's identifier in the constant table.
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
@@ -407,13 +965,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 /// @brief Parses a variable definition.
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 /// @brief Parses an argument list to a call.
 /// @returns The number of arguments.
@@ -434,25 +992,47 @@ static uint8_t argumentList() {
 
 /// @brief Parses a logical AND expression.
 static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    Condition* condition = outermostCondition();
+    if (condition != NULL) {
+        // The right operand stops before the next 'and' or 'or', which the condition's outermost loop parses in turn.
+        addJump(&condition->falseJumps, emitBranch(false));
+        parsePrecedence(PREC_EQUALITY);
+        return;
+    }
 
-    emitByte(OP_POP);
+    int endJump = emitJump(OP_JUMP_IF_FALSE_OR_POP);
     parsePrecedence(PREC_AND);
-
     patchJump(endJump);
 }
 /// @brief Parses a logical OR expression.
 static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
-
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    Condition* condition = outermostCondition();
+    if (condition != NULL) {
+        addJump(&condition->trueJumps, emitBranch(true));
+        // A false operand in the run of 'and's before this continues here.
+        patchJumps(&condition->falseJumps);
+        parsePrecedence(PREC_EQUALITY);
+        return;
+    }
 
+    int endJump = emitJump(OP_JUMP_IF_TRUE_OR_POP);
     parsePrecedence(PREC_OR);
     patchJump(endJump);
 }
 
+/// @brief Appends OP_ADD or OP_SUBTRACT, or its immediate form in place of the OP_INT before it if intOperand is set.
+static void emitArithmetic(uint8_t instruction, bool intOperand) {
+    if (!intOperand) {
+        emitByte(instruction);
+        return;
+    }
+    int16_t value = lastInt();
+    currentChunk()->count -= 3;
+    emitByte(instruction == OP_ADD ? OP_ADD_INT : OP_SUBTRACT_INT);
+    emitShort((uint16_t)value);
+    current->intEnd = -1;
+}
+
 /// @brief Parses a binary expression.
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
@@ -460,30 +1040,51 @@ static void binary(bool canAssign) {
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    int start = currentChunk()->count;
+    // Comparing with a nil literal branches on the other operand alone, and a small integer literal is added or subtracted
+    // as an immediate operand.
+    bool nilOperand = canFoldLast(current->nilEnd);
+    bool intOperand = canFoldLast(current->intEnd);
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
             emitBytes(OP_EQUAL, OP_NOT);
+            if (nilOperand) {
+                markComparison(start - 1, OP_JUMP_IF_NOT_NIL);
+            }
+            else {
+                markComparison(start, OP_JUMP_IF_NOT_EQUAL);
+            }
             break;
         case TOKEN_EQUAL_EQUAL:
             emitByte(OP_EQUAL);
+            if (nilOperand) {
+                markComparison(start - 1, OP_JUMP_IF_NIL);
+            }
+            else {
+                markComparison(start, OP_JUMP_IF_EQUAL);
+            }
             break;
         case TOKEN_GREATER:
             emitByte(OP_GREATER);
+            markComparison(start, OP_JUMP_IF_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
             emitBytes(OP_LESS, OP_NOT);
+            markComparison(start, OP_JUMP_IF_NOT_LESS);
             break;
         case TOKEN_LESS:
             emitByte(OP_LESS);
+            markComparison(start, OP_JUMP_IF_LESS);
             break;
         case TOKEN_LESS_EQUAL:
             emitBytes(OP_GREATER, OP_NOT);
+            markComparison(start, OP_JUMP_IF_NOT_GREATER);
             break;
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            emitArithmetic(OP_ADD, intOperand);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT);
+            emitArithmetic(OP_SUBTRACT, intOperand);
             break;
         case TOKEN_STAR:
             emitByte(OP_MULTIPLY);
@@ -496,18 +1097,31 @@ static void binary(bool canAssign) {
 
 /// @brief Parses a conditional (ternary) expression.
 static void conditional(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    JumpList thenJumps;
+    JumpList elseJumps;
+    Condition* condition = outermostCondition();
+    if (condition != NULL) {
+        // The outermost operands of a condition before the '?' branch to the two sides.
+        thenJumps = condition->trueJumps;
+        elseJumps = condition->falseJumps;
+        initJumpList(&condition->trueJumps);
+        initJumpList(&condition->falseJumps);
+    }
+    else {
+        initJumpList(&thenJumps);
+        initJumpList(&elseJumps);
+    }
+    addJump(&elseJumps, emitBranch(false));
+    patchJumps(&thenJumps);
 
     parsePrecedence(PREC_CONDITIONAL + 1);
-    int thenJump = emitJump(OP_JUMP);
+    int endJump = emitJump(OP_JUMP);
 
     consume(TOKEN_COLON, "Expect ':' in conditional expression.");
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJumps(&elseJumps);
     parsePrecedence(PREC_CONDITIONAL + 1);
-    patchJump(thenJump);
+    patchJump(endJump);
 }
 
 /// @brief Parses a call expression.
@@ -519,19 +1133,95 @@ static void call(bool canAssign) {
 /// @brief Parses a dot expression.
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    Token name = parser.previous;
 
     if (canAssign && match(TOKEN_EQUAL)) {
+        int constant = identifierConstant(&name);
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitIndexed(OP_SET_PROPERTY, constant);
     }
     else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         emitByte(OP_INVOKE);
-        emitBytes(name, argCount);
+        emitSelector(&name);
+        emitByte(argCount);
     }
     else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitIndexed(OP_GET_PROPERTY, identifierConstant(&name));
+    }
+}
+
+/// @brief Parses a subscript expression. Assumes the opening bracket has been consumed already.
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_INDEX_SET);
+    }
+    else {
+        emitByte(OP_INDEX_GET);
+    }
+}
+
+/// @brief Parses a list literal. Assumes the opening bracket has been consumed already.
+static void list(bool canAssign) {
+    // Elements are built into the list 255 at a time, which also bounds how many are on the stack at once.
+    bool built = false;
+    int elementCount = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            // Allows a trailing comma.
+            if (check(TOKEN_RIGHT_BRACKET)) {
+                break;
+            }
+            if (elementCount == UINT8_MAX) {
+                emitBytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, UINT8_MAX);
+                built = true;
+                elementCount = 0;
+            }
+            expression();
+            ++elementCount;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    if (!built) {
+        emitBytes(OP_BUILD_LIST, (uint8_t)elementCount);
+    }
+    else if (elementCount > 0) {
+        emitBytes(OP_EXTEND_LIST, (uint8_t)elementCount);
+    }
+}
+
+/// @brief Parses a map literal. Assumes the opening brace has been consumed already.
+static void map(bool canAssign) {
+    // Like list elements, entries are added 255 at a time.
+    bool built = false;
+    int pairCount = 0;
+    if (!check(TOKEN_RIGHT_BRACE)) {
+        do {
+            // Allows a trailing comma.
+            if (check(TOKEN_RIGHT_BRACE)) {
+                break;
+            }
+            if (pairCount == UINT8_MAX) {
+                emitBytes(built ? OP_EXTEND_MAP : OP_BUILD_MAP, UINT8_MAX);
+                built = true;
+                pairCount = 0;
+            }
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();
+            ++pairCount;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    if (!built) {
+        emitBytes(OP_BUILD_MAP, (uint8_t)pairCount);
+    }
+    else if (pairCount > 0) {
+        emitBytes(OP_EXTEND_MAP, (uint8_t)pairCount);
     }
 }
 
@@ -540,6 +1230,7 @@ static void literal(bool canAssign) {
     switch (parser.previous.type) {
         case TOKEN_NIL:
             emitByte(OP_NIL);
+            current->nilEnd = currentChunk()->count;
             break;
         case TOKEN_TRUE:
             emitByte(OP_TRUE);
@@ -561,12 +1252,20 @@ static void grouping(bool canAssign) {
 /// @brief Parses a number literal.
 static void number(bool canAssign) {
     double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    if (value <= INT16_MAX && value == (double)(int16_t)value) {
+        emitInt((int16_t)value);
+    }
+    else if (value <= INT32_MAX && value == (double)(int32_t)value) {
+        emitConstant(INT_VAL((int32_t)value));
+    }
+    else {
+        emitConstant(NUMBER_VAL(value));
+    }
 }
 
 /// @brief Parses a string literal.
 static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(sliceString(parser.source, parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 /// @brief Parses the use of a named variable.
@@ -589,10 +1288,10 @@ static void namedVariable(Token name, bool canAssign) {
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitIndexed(setOp, arg);
     }
     else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitIndexed(getOp, arg);
     }
 }
 
@@ -620,18 +1319,20 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    Token name = parser.previous;
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         int argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
         emitByte(OP_SUPER_INVOKE);
-        emitBytes(name, argCount);
+        emitSelector(&name);
+        emitByte(argCount);
     }
     else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitByte(OP_GET_SUPER);
+        emitSelector(&name);
     }
 }
 
@@ -652,10 +1353,19 @@ static void unary(bool canAssign) {
 
     switch (operatorType) {
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);
+            // Negating 0 gives -0, which isn't a small integer.
+            if (canFoldLast(current->intEnd) && lastInt() != 0 && lastInt() != INT16_MIN) {
+                int16_t value = -lastInt();
+                currentChunk()->count -= 3;
+                emitInt(value);
+            }
+            else {
+                emitByte(OP_NEGATE);
+            }
             break;
         case TOKEN_BANG:
             emitByte(OP_NOT);
+            current->notEnd = currentChunk()->count;
             break;
         default:
             // Unreachable
@@ -666,10 +1376,13 @@ static void unary(bool canAssign) {
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
+    [TOKEN_DOT_DOT] = {NULL, NULL, PREC_NONE},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -693,6 +1406,7 @@ ParseRule rules[] = {
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IN] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
@@ -734,7 +1448,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -743,18 +1457,20 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    emitIndexed(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
+    // A captured local can be in any slot, so its index takes two bytes.
     for (int i = 0; i < function->upvalueCount; ++i) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitShort(compiler.upvalues[i].index);
     }
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 /// @brief Parses a method.
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    Token name = parser.previous;
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
@@ -763,16 +1479,17 @@ static void method() {
 
     function(type);
 
-    emitBytes(OP_METHOD, constant);
+    emitByte(OP_METHOD);
+    emitSelector(&name);
 }
 /// @brief Parses a class declaration.
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
+    emitIndexed(OP_CLASS, nameConstant);
     defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
@@ -814,14 +1531,14 @@ static void classDeclaration() {
 }
 /// @brief Parses a function declaration. Assums the fun token has already been consumed.
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 /// @brief Parses a variable declaration. Assumes the var token has already been consumed.
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -843,25 +1560,25 @@ static void expressionStatement() {
 /// @brief Parses an if statement.
 static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    Condition condition;
+    beginCondition(&condition);
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    JumpList elseJumps;
+    endCondition(&condition, false, &elseJumps);
     // Then-branch
     statement();
 
-    int elseJump = emitJump(OP_JUMP);
-
-    patchJump(thenJump);
-
-    emitByte(OP_POP);
-
     if (match(TOKEN_ELSE)) {
+        int endJump = emitJump(OP_JUMP);
+        patchJumps(&elseJumps);
         statement();
+        patchJump(endJump);
+    }
+    else {
+        patchJumps(&elseJumps);
     }
-
-    patchJump(elseJump);
 }
 
 /// @brief Parses a print statement. Assumes the print token has already been consumed.
@@ -891,25 +1608,74 @@ static void returnStatement() {
 }
 /// @brief Parses a while loop.
 static void whileStatement() {
-    int loopStart = currentChunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+
+    // The condition is tested after the body, so that an iteration takes a single branch. The loop is entered by jumping
+    // to it.
+    int entryJump = emitJump(OP_JUMP);
+    CodeFragment condition;
+    JumpList loopJumps;
+    loopCondition(&condition, &loopJumps, TOKEN_RIGHT_PAREN, "Expect ')' after while condition.");
+
+    int bodyStart = currentChunk()->count;
+    statement();
+
+    patchJump(entryJump);
+    emitLoopCondition(&condition, &loopJumps, bodyStart);
+}
+/// @brief Parses the rest of a range loop, for (name in start..end), after the '('. The body runs with the variable set to
+/// each number from start up to but not including end. Assigning to it in the body doesn't change the iteration.
+static void rangeForStatement() {
+    consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+    Token name = parser.previous;
+    consume(TOKEN_IN, "Expect 'in' after loop variable.");
+
+    // The counter and the end are hidden locals, which only the loop instructions touch. Both bounds are evaluated before
+    // the loop variable is in scope.
     expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after while condition.");
+    consume(TOKEN_DOT_DOT, "Expect '..' between range bounds.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after range.");
+    addLocal(syntheticToken(""));
+    markInitialized();
+    addLocal(syntheticToken(""));
+    markInitialized();
+    uint16_t counterSlot = (uint16_t)(current->localCount - 2);
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    // Checks the bounds once and pushes the loop variable, then skips the loop if the range is empty. The counter slot
+    // takes two bytes, since there is no wide form of either instruction.
+    emitByte(OP_FOR_RANGE_ENTER);
+    emitShort(counterSlot);
+    emitBytes(0xff, 0xff);
+    int exitJump = currentChunk()->count - 2;
+    addLocal(name);
+    markInitialized();
 
+    int bodyStart = currentChunk()->count;
     statement();
-    emitLoop(loopStart);
 
+    // Steps the counter and jumps back to the body while it is below the end.
+    emitByte(OP_FOR_RANGE);
+    emitShort(counterSlot);
+    int offset = currentChunk()->count - bodyStart + 2;
+    if (offset > UINT16_MAX) {
+        error("Loop body too large.");
+    }
+    emitBytes((offset >> 8) & 0xff, offset & 0xff);
     patchJump(exitJump);
-    emitByte(OP_POP);
 }
+
 /// @brief Parses a for loop.
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
+    if (check(TOKEN_IDENTIFIER) && peekToken().type == TOKEN_IN) {
+        rangeForStatement();
+        endScope();
+        return;
+    }
+
     // Initializer
     if (match(TOKEN_SEMICOLON)) {
         // No initializer
@@ -921,38 +1687,34 @@ static void forStatement() {
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->count;
-
-    // Condition
-    int exitJump = -1;
+    // Like a while loop, the condition is tested after the body and the increment, and the loop is entered by jumping to it.
+    int entryJump = -1;
+    CodeFragment condition;
+    JumpList loopJumps;
     if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after for condition.");
-
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        entryJump = emitJump(OP_JUMP);
+        loopCondition(&condition, &loopJumps, TOKEN_SEMICOLON, "Expect ';' after for condition.");
     }
 
-    // Increment
+    CodeFragment increment = {0};
     if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
         int incrementStart = currentChunk()->count;
-
         expression();
         emitByte(OP_POP);
-
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-        emitLoop(loopStart);
-        loopStart = incrementStart;
-        patchJump(bodyJump);
+        cutCode(incrementStart, &increment);
     }
 
+    int bodyStart = currentChunk()->count;
     statement();
-    emitLoop(loopStart);
-    if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+    pasteCode(&increment);
+
+    if (entryJump != -1) {
+        patchJump(entryJump);
+        emitLoopCondition(&condition, &loopJumps, bodyStart);
+    }
+    else {
+        emitLoop(bodyStart);
     }
     endScope();
 }
@@ -1025,11 +1787,13 @@ static void statement() {
 }
 
 static void parsePrecedence(Precedence precedence) {
+    ++current->expressionDepth;
     advance();
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
 
     if (prefixRule == NULL) {
         error("Expect expression.");
+        --current->expressionDepth;
         return;
     }
 
@@ -1045,13 +1809,15 @@ static void parsePrecedence(Precedence precedence) {
     if (canAssign && match(TOKEN_EQUAL)) {
         error("Invalid assignment target.");
     }
+    --current->expressionDepth;
 }
 static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-ObjFunction* compile(const char* source) {
-    initScanner(source);
+ObjFunction* compile(ObjString* source) {
+    parser.source = source;
+    initScanner(stringChars(source));
 
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT);
@@ -1068,10 +1834,12 @@ ObjFunction* compile(const char* source) {
     consume(TOKEN_EOF, "Expect end of expression");
 
     ObjFunction* function = endCompiler();
+    parser.source = NULL;
 
     return parser.hadError ? NULL : function;
 }
 void markCompilerRoots() {
+    markObject((Obj*)parser.source);
     Compiler* compiler = current;
     while (compiler != NULL) {
         markObject((Obj*)compiler->function);
@@ -3,23 +3,41 @@
 #include "../include/debug.h"
 #include "../include/object.h"
 #include "../include/value.h"
+#include "../include/vm.h"
 
-/// @brief Outputs a representation of a constant instruction and its corresponding value.
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-    int constantIndex = chunk->code[offset + 1];
+/// @brief Outputs an instruction's name, its constant index operand and the constant.
+static void printConstant(const char* name, Chunk* chunk, int constantIndex) {
     printf("%-16s %4d '", name, constantIndex);
     printValue(chunk->constants.values[constantIndex]);
     printf("'\n");
+}
+/// @brief Outputs a representation of a constant instruction and its corresponding value.
+static int constantInstruction(const char* name, Chunk* chunk, int offset) {
+    printConstant(name, chunk, chunk->code[offset + 1]);
     return offset + 2;
 }
+/// @brief Outputs a representation of an instruction with a signed two-byte integer operand.
+static int intInstruction(const char* name, Chunk* chunk, int offset) {
+    int16_t value = (int16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d\n", name, value);
+    return offset + 3;
+}
+/// @brief Outputs a representation of an instruction with a method selector operand and its method name.
+static int selectorInstruction(const char* name, Chunk* chunk, int offset) {
+    int selector = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '", name, selector);
+    printValue(vm.selectorNames.values[selector]);
+    printf("'\n");
+    return offset + 3;
+}
 /// @brief Outputs a representation of an invoke instruction.
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, argCount, constant);
-    printValue(chunk->constants.values[constant]);
+    int selector = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 3];
+    printf("%-16s (%d args) %4d '", name, argCount, selector);
+    printValue(vm.selectorNames.values[selector]);
     printf("'\n");
-    return offset + 3;
+    return offset + 4;
 }
 /// @brief Outputs a representation of a simple, one-byte instruction.
 static int simpleInstruction(const char* name, int offset) {
@@ -36,10 +54,83 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
 
-    printf("%-16s %4d -> %d", name, offset, offset + 3 + sign * jump);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
+/// @brief Outputs a representation of a range loop instruction, which has a counter slot and a jump operand.
+static int rangeInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+
+    printf("%-16s %4d %4d -> %d\n", name, slot, offset, offset + 5 + sign * jump);
+    return offset + 5;
+}
+
+/// @brief Outputs a representation of a closure instruction, whose upvalue descriptors start at the given offset.
+static int closureInstruction(const char* name, Chunk* chunk, int constant, int offset) {
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int i = 0; i < function->upvalueCount; ++i) {
+        int isLocal = chunk->code[offset];
+        int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        printf("%04d      |                     %s %d\n", offset, isLocal ? "local" : "upvalue", index);
+        offset += 3;
+    }
+    return offset;
+}
+
+/// @brief Outputs a representation of an instruction behind OP_WIDE, whose index operand takes two bytes.
+static int wideInstruction(Chunk* chunk, int offset) {
+    uint8_t instruction = chunk->code[offset + 1];
+    int index = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("OP_WIDE ");
+    switch (instruction) {
+        case OP_CONSTANT:
+            printConstant("OP_CONSTANT", chunk, index);
+            break;
+        case OP_DEFINE_GLOBAL:
+            printConstant("OP_DEFINE_GLOBAL", chunk, index);
+            break;
+        case OP_GET_LOCAL:
+            printf("%-16s %4d\n", "OP_GET_LOCAL", index);
+            break;
+        case OP_SET_LOCAL:
+            printf("%-16s %4d\n", "OP_SET_LOCAL", index);
+            break;
+        case OP_GET_UPVALUE:
+            printf("%-16s %4d\n", "OP_GET_UPVALUE", index);
+            break;
+        case OP_SET_UPVALUE:
+            printf("%-16s %4d\n", "OP_SET_UPVALUE", index);
+            break;
+        case OP_GET_GLOBAL:
+            printConstant("OP_GET_GLOBAL", chunk, index);
+            break;
+        case OP_SET_GLOBAL:
+            printConstant("OP_SET_GLOBAL", chunk, index);
+            break;
+        case OP_GET_PROPERTY:
+            printConstant("OP_GET_PROPERTY", chunk, index);
+            break;
+        case OP_SET_PROPERTY:
+            printConstant("OP_SET_PROPERTY", chunk, index);
+            break;
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, index, offset + 4);
+        case OP_CLASS:
+            printConstant("OP_CLASS", chunk, index);
+            break;
+        default:
+            printf("Unknown opcode %d\n", instruction);
+            break;
+    }
+    return offset + 4;
+}
+
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
@@ -63,8 +154,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
+        case OP_WIDE:
+            return wideInstruction(chunk, offset);
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_INT:
+            return intInstruction("OP_INT", chunk, offset);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -92,7 +187,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return selectorInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_INDEX_GET:
+            return simpleInstruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+            return simpleInstruction("OP_INDEX_SET", offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -107,6 +206,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
             return simpleInstruction("OP_DIVIDE", offset);
+        case OP_ADD_INT:
+            return intInstruction("OP_ADD_INT", chunk, offset);
+        case OP_SUBTRACT_INT:
+            return intInstruction("OP_SUBTRACT_INT", chunk, offset);
         case OP_NOT:
             return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
@@ -115,42 +218,84 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
-        case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_OR_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_OR_POP", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE_OR_POP:
+            return jumpInstruction("OP_JUMP_IF_TRUE_OR_POP", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+        case OP_JUMP_IF_LESS:
+            return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_GREATER:
+            return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NIL:
+            return jumpInstruction("OP_JUMP_IF_NIL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_NIL:
+            return jumpInstruction("OP_JUMP_IF_NOT_NIL", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_POP_LOOP_IF_FALSE:
+            return jumpInstruction("OP_POP_LOOP_IF_FALSE", -1, chunk, offset);
+        case OP_POP_LOOP_IF_TRUE:
+            return jumpInstruction("OP_POP_LOOP_IF_TRUE", -1, chunk, offset);
+        case OP_LOOP_IF_LESS:
+            return jumpInstruction("OP_LOOP_IF_LESS", -1, chunk, offset);
+        case OP_LOOP_IF_NOT_LESS:
+            return jumpInstruction("OP_LOOP_IF_NOT_LESS", -1, chunk, offset);
+        case OP_LOOP_IF_GREATER:
+            return jumpInstruction("OP_LOOP_IF_GREATER", -1, chunk, offset);
+        case OP_LOOP_IF_NOT_GREATER:
+            return jumpInstruction("OP_LOOP_IF_NOT_GREATER", -1, chunk, offset);
+        case OP_LOOP_IF_EQUAL:
+            return jumpInstruction("OP_LOOP_IF_EQUAL", -1, chunk, offset);
+        case OP_LOOP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_LOOP_IF_NOT_EQUAL", -1, chunk, offset);
+        case OP_LOOP_IF_NIL:
+            return jumpInstruction("OP_LOOP_IF_NIL", -1, chunk, offset);
+        case OP_LOOP_IF_NOT_NIL:
+            return jumpInstruction("OP_LOOP_IF_NOT_NIL", -1, chunk, offset);
+        case OP_FOR_RANGE_ENTER:
+            return rangeInstruction("OP_FOR_RANGE_ENTER", 1, chunk, offset);
+        case OP_FOR_RANGE:
+            return rangeInstruction("OP_FOR_RANGE", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
-            ++offset;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int i = 0; i < function->upvalueCount; ++i) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-
-            return offset;
-        }
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, chunk->code[offset + 1], offset + 2);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_RETURN_NIL:
+            return simpleInstruction("OP_RETURN_NIL", offset);
         case OP_CLASS:
             return constantInstruction("OP_CLASS", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return selectorInstruction("OP_METHOD", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_EXTEND_LIST:
+            return byteInstruction("OP_EXTEND_LIST", chunk, offset);
+        case OP_BUILD_MAP:
+            return byteInstruction("OP_BUILD_MAP", chunk, offset);
+        case OP_EXTEND_MAP:
+            return byteInstruction("OP_EXTEND_MAP", chunk, offset);
         default:
             printf("Unknown opcode %d", instruction);
             return offset + 1;
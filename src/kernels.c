@@ -0,0 +1,503 @@
+#include <math.h>
+
+#include "../include/kernels.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+/// @brief Whether the AVX2 kernels are compiled in. They are built for AVX2 on their own and only called if the CPU has it.
+#define KERNELS_AVX2
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// A multiply followed by an add must round twice on every level, even where the compiler could fuse them.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+/// @brief Number of partial sums that reductions spread their elements over, one per vector lane on every level.
+#define PARTIALS 8
+
+/// @returns The smaller of two doubles, b if they are equal. The same as the minpd instruction.
+static inline double minOf(double a, double b) {
+    return a < b ? a : b;
+}
+/// @returns The larger of two doubles, b if they are equal. The same as the maxpd instruction.
+static inline double maxOf(double a, double b) {
+    return a > b ? a : b;
+}
+
+// Scalar kernels, which define the order that the others compute in. Element i of each block of PARTIALS goes into partial
+// sum i, and the partials are combined as (p0 + p4) + (p2 + p6) and (p1 + p5) + (p3 + p7), then those two are added.
+
+static double sumScalar(const double* x, size_t n) {
+    double partials[PARTIALS] = {0};
+    size_t i = 0;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        for (int lane = 0; lane < PARTIALS; ++lane) {
+            partials[lane] += x[i + lane];
+        }
+    }
+    for (int lane = 0; lane < 4; ++lane) {
+        partials[lane] += partials[lane + 4];
+    }
+    double result = (partials[0] + partials[2]) + (partials[1] + partials[3]);
+    for (; i < n; ++i) {
+        result += x[i];
+    }
+    return result;
+}
+static double dotScalar(const double* x, const double* y, size_t n) {
+    double partials[PARTIALS] = {0};
+    size_t i = 0;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        for (int lane = 0; lane < PARTIALS; ++lane) {
+            partials[lane] += x[i + lane] * y[i + lane];
+        }
+    }
+    for (int lane = 0; lane < 4; ++lane) {
+        partials[lane] += partials[lane + 4];
+    }
+    double result = (partials[0] + partials[2]) + (partials[1] + partials[3]);
+    for (; i < n; ++i) {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+static double minScalar(const double* x, size_t n) {
+    double result = x[0];
+    bool unordered = isnan(x[0]);
+    size_t i = 1;
+    if (n >= PARTIALS) {
+        double partials[PARTIALS];
+        for (int lane = 0; lane < PARTIALS; ++lane) {
+            partials[lane] = x[lane];
+            unordered |= isnan(x[lane]);
+        }
+        for (i = PARTIALS; i + PARTIALS <= n; i += PARTIALS) {
+            for (int lane = 0; lane < PARTIALS; ++lane) {
+                partials[lane] = minOf(x[i + lane], partials[lane]);
+                unordered |= isnan(x[i + lane]);
+            }
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            partials[lane] = minOf(partials[lane + 4], partials[lane]);
+        }
+        result = minOf(minOf(partials[1], partials[0]), minOf(partials[3], partials[2]));
+    }
+    for (; i < n; ++i) {
+        result = minOf(x[i], result);
+        unordered |= isnan(x[i]);
+    }
+    return unordered ? NAN : result;
+}
+static double maxScalar(const double* x, size_t n) {
+    double result = x[0];
+    bool unordered = isnan(x[0]);
+    size_t i = 1;
+    if (n >= PARTIALS) {
+        double partials[PARTIALS];
+        for (int lane = 0; lane < PARTIALS; ++lane) {
+            partials[lane] = x[lane];
+            unordered |= isnan(x[lane]);
+        }
+        for (i = PARTIALS; i + PARTIALS <= n; i += PARTIALS) {
+            for (int lane = 0; lane < PARTIALS; ++lane) {
+                partials[lane] = maxOf(x[i + lane], partials[lane]);
+                unordered |= isnan(x[i + lane]);
+            }
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            partials[lane] = maxOf(partials[lane + 4], partials[lane]);
+        }
+        result = maxOf(maxOf(partials[1], partials[0]), maxOf(partials[3], partials[2]));
+    }
+    for (; i < n; ++i) {
+        result = maxOf(x[i], result);
+        unordered |= isnan(x[i]);
+    }
+    return unordered ? NAN : result;
+}
+static void scaleScalar(double* x, size_t n, double factor) {
+    for (size_t i = 0; i < n; ++i) {
+        x[i] *= factor;
+    }
+}
+static void axpyScalar(double* y, const double* x, size_t n, double alpha) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+static void addScalar(double* y, const double* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] += x[i];
+    }
+}
+static void subScalar(double* y, const double* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] -= x[i];
+    }
+}
+static void mulScalar(double* y, const double* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] *= x[i];
+    }
+}
+static void divScalar(double* y, const double* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] /= x[i];
+    }
+}
+// Works on pairs: both elements of a pair are offset by the carry from before the pair, so that two lanes can do it at once.
+static double prefixSumScalar(double* x, size_t n, double carry) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        double pair = x[i] + x[i + 1];
+        x[i] = carry + x[i];
+        x[i + 1] = carry + pair;
+        carry = x[i + 1];
+    }
+    if (i < n) {
+        x[i] = carry + x[i];
+        carry = x[i];
+    }
+    return carry;
+}
+
+static const Float64Kernels scalarKernels = {
+    KERNEL_SCALAR, sumScalar, dotScalar, minScalar, maxScalar, scaleScalar, axpyScalar,
+    addScalar, subScalar, mulScalar, divScalar, prefixSumScalar,
+};
+
+#ifdef __SSE2__
+static double sumSSE2(const double* x, size_t n) {
+    __m128d partials[4] = {_mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd()};
+    size_t i = 0;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        for (int vector = 0; vector < 4; ++vector) {
+            partials[vector] = _mm_add_pd(partials[vector], _mm_loadu_pd(x + i + 2 * vector));
+        }
+    }
+    __m128d half = _mm_add_pd(_mm_add_pd(partials[0], partials[2]), _mm_add_pd(partials[1], partials[3]));
+    double result = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i < n; ++i) {
+        result += x[i];
+    }
+    return result;
+}
+static double dotSSE2(const double* x, const double* y, size_t n) {
+    __m128d partials[4] = {_mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd()};
+    size_t i = 0;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        for (int vector = 0; vector < 4; ++vector) {
+            __m128d product = _mm_mul_pd(_mm_loadu_pd(x + i + 2 * vector), _mm_loadu_pd(y + i + 2 * vector));
+            partials[vector] = _mm_add_pd(partials[vector], product);
+        }
+    }
+    __m128d half = _mm_add_pd(_mm_add_pd(partials[0], partials[2]), _mm_add_pd(partials[1], partials[3]));
+    double result = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i < n; ++i) {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+static double minSSE2(const double* x, size_t n) {
+    if (n < PARTIALS) {
+        return minScalar(x, n);
+    }
+    __m128d partials[4];
+    __m128d unordered = _mm_setzero_pd();
+    for (int vector = 0; vector < 4; ++vector) {
+        partials[vector] = _mm_loadu_pd(x + 2 * vector);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(partials[vector], partials[vector]));
+    }
+    size_t i = PARTIALS;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        for (int vector = 0; vector < 4; ++vector) {
+            __m128d elements = _mm_loadu_pd(x + i + 2 * vector);
+            partials[vector] = _mm_min_pd(elements, partials[vector]);
+            unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(elements, elements));
+        }
+    }
+    __m128d low = _mm_min_pd(partials[2], partials[0]);
+    __m128d high = _mm_min_pd(partials[3], partials[1]);
+    double result = minOf(minOf(_mm_cvtsd_f64(_mm_unpackhi_pd(low, low)), _mm_cvtsd_f64(low)),
+                          minOf(_mm_cvtsd_f64(_mm_unpackhi_pd(high, high)), _mm_cvtsd_f64(high)));
+    bool anyUnordered = _mm_movemask_pd(unordered) != 0;
+    for (; i < n; ++i) {
+        result = minOf(x[i], result);
+        anyUnordered |= isnan(x[i]);
+    }
+    return anyUnordered ? NAN : result;
+}
+static double maxSSE2(const double* x, size_t n) {
+    if (n < PARTIALS) {
+        return maxScalar(x, n);
+    }
+    __m128d partials[4];
+    __m128d unordered = _mm_setzero_pd();
+    for (int vector = 0; vector < 4; ++vector) {
+        partials[vector] = _mm_loadu_pd(x + 2 * vector);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(partials[vector], partials[vector]));
+    }
+    size_t i = PARTIALS;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        for (int vector = 0; vector < 4; ++vector) {
+            __m128d elements = _mm_loadu_pd(x + i + 2 * vector);
+            partials[vector] = _mm_max_pd(elements, partials[vector]);
+            unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(elements, elements));
+        }
+    }
+    __m128d low = _mm_max_pd(partials[2], partials[0]);
+    __m128d high = _mm_max_pd(partials[3], partials[1]);
+    double result = maxOf(maxOf(_mm_cvtsd_f64(_mm_unpackhi_pd(low, low)), _mm_cvtsd_f64(low)),
+                          maxOf(_mm_cvtsd_f64(_mm_unpackhi_pd(high, high)), _mm_cvtsd_f64(high)));
+    bool anyUnordered = _mm_movemask_pd(unordered) != 0;
+    for (; i < n; ++i) {
+        result = maxOf(x[i], result);
+        anyUnordered |= isnan(x[i]);
+    }
+    return anyUnordered ? NAN : result;
+}
+static void scaleSSE2(double* x, size_t n, double factor) {
+    __m128d factors = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), factors));
+    }
+    scaleScalar(x + i, n - i, factor);
+}
+static void axpySSE2(double* y, const double* x, size_t n, double alpha) {
+    __m128d alphas = _mm_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(alphas, _mm_loadu_pd(x + i))));
+    }
+    axpyScalar(y + i, x + i, n - i, alpha);
+}
+
+/// @brief Defines an SSE2 kernel that applies an instruction elementwise, finishing with the scalar kernel.
+#define ELEMENTWISE_SSE2(name, instruction)                                                       \
+    static void name##SSE2(double* y, const double* x, size_t n) {                                \
+        size_t i = 0;                                                                             \
+        for (; i + 2 <= n; i += 2) {                                                              \
+            _mm_storeu_pd(y + i, instruction(_mm_loadu_pd(y + i), _mm_loadu_pd(x + i)));          \
+        }                                                                                         \
+        name##Scalar(y + i, x + i, n - i);                                                        \
+    }
+
+ELEMENTWISE_SSE2(add, _mm_add_pd)
+ELEMENTWISE_SSE2(sub, _mm_sub_pd)
+ELEMENTWISE_SSE2(mul, _mm_mul_pd)
+ELEMENTWISE_SSE2(div, _mm_div_pd)
+
+#undef ELEMENTWISE_SSE2
+
+static double prefixSumSSE2(double* x, size_t n, double carry) {
+    // Adding -0 leaves every double unchanged, so the first lane matches the scalar order exactly.
+    __m128d negativeZero = _mm_set1_pd(-0.0);
+    __m128d carries = _mm_set1_pd(carry);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d pair = _mm_loadu_pd(x + i);
+        __m128d sums = _mm_add_pd(pair, _mm_unpacklo_pd(negativeZero, pair));
+        sums = _mm_add_pd(carries, sums);
+        _mm_storeu_pd(x + i, sums);
+        carries = _mm_unpackhi_pd(sums, sums);
+    }
+    return prefixSumScalar(x + i, n - i, _mm_cvtsd_f64(carries));
+}
+
+static const Float64Kernels sse2Kernels = {
+    KERNEL_SSE2, sumSSE2, dotSSE2, minSSE2, maxSSE2, scaleSSE2, axpySSE2,
+    addSSE2, subSSE2, mulSSE2, divSSE2, prefixSumSSE2,
+};
+#endif
+
+#ifdef KERNELS_AVX2
+/// @returns The sum of the two halves of a vector of four doubles.
+TARGET_AVX2 static inline __m128d foldHalves(__m256d vector) {
+    return _mm_add_pd(_mm256_castpd256_pd128(vector), _mm256_extractf128_pd(vector, 1));
+}
+
+TARGET_AVX2 static double sumAVX2(const double* x, size_t n) {
+    __m256d low = _mm256_setzero_pd();
+    __m256d high = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        low = _mm256_add_pd(low, _mm256_loadu_pd(x + i));
+        high = _mm256_add_pd(high, _mm256_loadu_pd(x + i + 4));
+    }
+    __m128d half = foldHalves(_mm256_add_pd(low, high));
+    double result = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i < n; ++i) {
+        result += x[i];
+    }
+    return result;
+}
+TARGET_AVX2 static double dotAVX2(const double* x, const double* y, size_t n) {
+    __m256d low = _mm256_setzero_pd();
+    __m256d high = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        high = _mm256_add_pd(high, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    __m128d half = foldHalves(_mm256_add_pd(low, high));
+    double result = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i < n; ++i) {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+TARGET_AVX2 static double minAVX2(const double* x, size_t n) {
+    if (n < PARTIALS) {
+        return minScalar(x, n);
+    }
+    __m256d low = _mm256_loadu_pd(x);
+    __m256d high = _mm256_loadu_pd(x + 4);
+    __m256d unordered = _mm256_or_pd(_mm256_cmp_pd(low, low, _CMP_UNORD_Q), _mm256_cmp_pd(high, high, _CMP_UNORD_Q));
+    size_t i = PARTIALS;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        __m256d lowElements = _mm256_loadu_pd(x + i);
+        __m256d highElements = _mm256_loadu_pd(x + i + 4);
+        low = _mm256_min_pd(lowElements, low);
+        high = _mm256_min_pd(highElements, high);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(lowElements, lowElements, _CMP_UNORD_Q));
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(highElements, highElements, _CMP_UNORD_Q));
+    }
+    double partials[4];
+    _mm256_storeu_pd(partials, _mm256_min_pd(high, low));
+    double result = minOf(minOf(partials[1], partials[0]), minOf(partials[3], partials[2]));
+    bool anyUnordered = _mm256_movemask_pd(unordered) != 0;
+    for (; i < n; ++i) {
+        result = minOf(x[i], result);
+        anyUnordered |= isnan(x[i]);
+    }
+    return anyUnordered ? NAN : result;
+}
+TARGET_AVX2 static double maxAVX2(const double* x, size_t n) {
+    if (n < PARTIALS) {
+        return maxScalar(x, n);
+    }
+    __m256d low = _mm256_loadu_pd(x);
+    __m256d high = _mm256_loadu_pd(x + 4);
+    __m256d unordered = _mm256_or_pd(_mm256_cmp_pd(low, low, _CMP_UNORD_Q), _mm256_cmp_pd(high, high, _CMP_UNORD_Q));
+    size_t i = PARTIALS;
+    for (; i + PARTIALS <= n; i += PARTIALS) {
+        __m256d lowElements = _mm256_loadu_pd(x + i);
+        __m256d highElements = _mm256_loadu_pd(x + i + 4);
+        low = _mm256_max_pd(lowElements, low);
+        high = _mm256_max_pd(highElements, high);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(lowElements, lowElements, _CMP_UNORD_Q));
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(highElements, highElements, _CMP_UNORD_Q));
+    }
+    double partials[4];
+    _mm256_storeu_pd(partials, _mm256_max_pd(high, low));
+    double result = maxOf(maxOf(partials[1], partials[0]), maxOf(partials[3], partials[2]));
+    bool anyUnordered = _mm256_movemask_pd(unordered) != 0;
+    for (; i < n; ++i) {
+        result = maxOf(x[i], result);
+        anyUnordered |= isnan(x[i]);
+    }
+    return anyUnordered ? NAN : result;
+}
+TARGET_AVX2 static void scaleAVX2(double* x, size_t n, double factor) {
+    __m256d factors = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), factors));
+    }
+    scaleScalar(x + i, n - i, factor);
+}
+TARGET_AVX2 static void axpyAVX2(double* y, const double* x, size_t n, double alpha) {
+    __m256d alphas = _mm256_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(alphas, _mm256_loadu_pd(x + i))));
+    }
+    axpyScalar(y + i, x + i, n - i, alpha);
+}
+
+/// @brief Defines an AVX2 kernel that applies an instruction elementwise, finishing with the scalar kernel.
+#define ELEMENTWISE_AVX2(name, instruction)                                                       \
+    TARGET_AVX2 static void name##AVX2(double* y, const double* x, size_t n) {                    \
+        size_t i = 0;                                                                             \
+        for (; i + 4 <= n; i += 4) {                                                              \
+            _mm256_storeu_pd(y + i, instruction(_mm256_loadu_pd(y + i), _mm256_loadu_pd(x + i))); \
+        }                                                                                         \
+        name##Scalar(y + i, x + i, n - i);                                                        \
+    }
+
+ELEMENTWISE_AVX2(add, _mm256_add_pd)
+ELEMENTWISE_AVX2(sub, _mm256_sub_pd)
+ELEMENTWISE_AVX2(mul, _mm256_mul_pd)
+ELEMENTWISE_AVX2(div, _mm256_div_pd)
+
+#undef ELEMENTWISE_AVX2
+
+// A prefix sum is a chain of dependent adds that wider vectors can't shorten without changing the order of the additions,
+// so AVX2 uses the SSE2 kernel. Any x86 CPU with AVX2 has SSE2.
+static const Float64Kernels avx2Kernels = {
+    KERNEL_AVX2, sumAVX2, dotAVX2, minAVX2, maxAVX2, scaleAVX2, axpyAVX2,
+    addAVX2, subAVX2, mulAVX2, divAVX2, prefixSumSSE2,
+};
+#endif
+
+Float64Kernels float64Kernels = {
+    KERNEL_SCALAR, sumScalar, dotScalar, minScalar, maxScalar, scaleScalar, axpyScalar,
+    addScalar, subScalar, mulScalar, divScalar, prefixSumScalar,
+};
+
+KernelLevel detectKernelLevel() {
+#ifdef KERNELS_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return KERNEL_AVX2;
+    }
+#endif
+#ifdef __SSE2__
+    return KERNEL_SSE2;
+#else
+    return KERNEL_SCALAR;
+#endif
+}
+
+void selectKernels(KernelLevel level) {
+    KernelLevel supported = detectKernelLevel();
+    if (level > supported) {
+        level = supported;
+    }
+    switch (level) {
+#ifdef KERNELS_AVX2
+        case KERNEL_AVX2:
+            float64Kernels = avx2Kernels;
+            return;
+#endif
+#ifdef __SSE2__
+        case KERNEL_SSE2:
+            float64Kernels = sse2Kernels;
+            return;
+#endif
+        default:
+            float64Kernels = scalarKernels;
+            return;
+    }
+}
+
+const char* kernelLevelName(KernelLevel level) {
+    switch (level) {
+        case KERNEL_SCALAR:
+            return "scalar";
+        case KERNEL_SSE2:
+            return "sse2";
+        case KERNEL_AVX2:
+            return "avx2";
+    }
+    return "unknown";
+}
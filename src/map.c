@@ -0,0 +1,270 @@
+#include <string.h>
+
+#include "../include/map.h"
+#include "../include/memory.h"
+#include "../include/object.h"
+#include "../include/value.h"
+
+/// @brief A map's maximum load factor. Slots of removed entries count against it until the map is rebuilt.
+#define MAP_MAX_LOAD 0.75
+/// @brief Smallest slot capacity of a non-empty map.
+#define MAP_MIN_CAPACITY 8
+
+/// @brief Slot that has never held an entry.
+#define SLOT_EMPTY (-1)
+/// @brief Slot whose entry was removed.
+#define SLOT_REMOVED (-2)
+
+/// @returns The number of entries a map with the given slot capacity holds before it is rebuilt.
+static int entryCapacityFor(int slotCapacity) {
+    return (int)(slotCapacity * MAP_MAX_LOAD);
+}
+
+/// @returns The form of a key that the map stores and compares. Equal keys have the same form, except for strings, whose
+/// representations differ but are hashed by content. Flattens ropes, so the key must be reachable by the GC.
+static Value canonicalKey(Value key) {
+    if (IS_ROPE(key)) {
+        return OBJ_VAL(flattenRope(AS_ROPE(key)));
+    }
+#ifdef NAN_BOXING
+    // Integral doubles equal the small ints with the same value, and -0 equals 0.
+    if (IS_NUMBER(key) && !IS_INT(key)) {
+        double number = AS_NUMBER(key);
+        if (number >= INT32_MIN && number <= INT32_MAX && (double)(int32_t)number == number) {
+            return INT_VAL((int32_t)number);
+        }
+    }
+#else
+    if (IS_NUMBER(key) && AS_NUMBER(key) == 0) {
+        return NUMBER_VAL(0);
+    }
+#endif
+    return key;
+}
+
+/// @returns The hash of a canonical key. Strings are hashed by content, other objects by address.
+static uint32_t hashKey(Value key) {
+    if (IS_STRING(key)) {
+        return stringHash(AS_STRING(key));
+    }
+#ifdef NAN_BOXING
+    return hashBits(key);
+#else
+    switch (key.type) {
+        case VAL_BOOL:
+            return hashBits(AS_BOOL(key));
+        case VAL_NUMBER: {
+            uint64_t bits;
+            double number = AS_NUMBER(key);
+            memcpy(&bits, &number, sizeof(bits));
+            return hashBits(bits);
+        }
+        case VAL_OBJ:
+            return hashBits((uintptr_t)AS_OBJ(key));
+        default:
+            return hashBits(0);
+    }
+#endif
+}
+
+/// @returns Whether two canonical keys are equal.
+static inline bool keysEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Only strings have more than one form, which are compared by content.
+    return a == b || (IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_OBJ(a), AS_OBJ(b)));
+#else
+    return valuesEqual(a, b);
+#endif
+}
+
+/// @brief Looks for the slot of a canonical key.
+/// @returns The key's slot, or if it isn't in the map, the slot to add it in.
+static int32_t* findSlot(Map* map, Value key, uint32_t hash) {
+    uint32_t mask = (uint32_t)map->slotCapacity - 1;
+    uint32_t index = hash & mask;
+    int32_t* removed = NULL;
+    while (true) {
+        int32_t* slot = &map->slots[index];
+        if (*slot == SLOT_EMPTY) {
+            return removed != NULL ? removed : slot;
+        }
+        if (*slot == SLOT_REMOVED) {
+            if (removed == NULL) {
+                removed = slot;
+            }
+        }
+        else {
+            MapEntry* entry = &map->entries[*slot];
+            if (entry->hash == hash && keysEqual(entry->key, key)) {
+                return slot;
+            }
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+/// @brief Points a slot at every live entry, starting from empty slots.
+static void fillSlots(Map* map) {
+    for (int i = 0; i < map->slotCapacity; ++i) {
+        map->slots[i] = SLOT_EMPTY;
+    }
+    uint32_t mask = (uint32_t)map->slotCapacity - 1;
+    for (int i = 0; i < map->entryCount; ++i) {
+        if (map->entries[i].removed) {
+            continue;
+        }
+        uint32_t index = map->entries[i].hash & mask;
+        while (map->slots[index] != SLOT_EMPTY) {
+            index = (index + 1) & mask;
+        }
+        map->slots[index] = i;
+    }
+}
+
+/// @brief Drops the removed entries and gives the map the given slot capacity, which must hold all of its live entries.
+static void rebuildMap(Map* map, int slotCapacity) {
+    int entryCapacity = entryCapacityFor(slotCapacity);
+    if (entryCapacity != map->entryCapacity) {
+        map->entries = GROW_ARRAY(MapEntry, map->entries, map->entryCapacity, entryCapacity);
+        map->entryCapacity = entryCapacity;
+    }
+
+    // Packing the live entries to the front keeps their order.
+    int count = 0;
+    for (int i = 0; i < map->entryCount; ++i) {
+        if (!map->entries[i].removed) {
+            map->entries[count++] = map->entries[i];
+        }
+    }
+    map->entryCount = count;
+
+    if (slotCapacity != map->slotCapacity) {
+        FREE_ARRAY(int32_t, map->slots, map->slotCapacity);
+        map->slots = ALLOCATE(int32_t, slotCapacity);
+        map->slotCapacity = slotCapacity;
+    }
+    fillSlots(map);
+}
+
+void initMap(Map* map) {
+    map->count = 0;
+    map->entryCount = 0;
+    map->entryCapacity = 0;
+    map->entries = NULL;
+    map->slotCapacity = 0;
+    map->slots = NULL;
+}
+
+void freeMap(Map* map) {
+    FREE_ARRAY(MapEntry, map->entries, map->entryCapacity);
+    FREE_ARRAY(int32_t, map->slots, map->slotCapacity);
+    initMap(map);
+}
+
+void mapReserve(Map* map, int count) {
+    int slotCapacity = map->slotCapacity > 0 ? map->slotCapacity : MAP_MIN_CAPACITY;
+    while (entryCapacityFor(slotCapacity) < map->count + count) {
+        slotCapacity *= 2;
+    }
+    if (slotCapacity > map->slotCapacity) {
+        rebuildMap(map, slotCapacity);
+    }
+}
+
+bool mapGet(Map* map, Value key, Value* out) {
+    if (map->count == 0) {
+        return false;
+    }
+
+    key = canonicalKey(key);
+    int32_t slot = *findSlot(map, key, hashKey(key));
+    if (slot < 0) {
+        return false;
+    }
+    *out = map->entries[slot].value;
+    return true;
+}
+
+bool mapSet(Map* map, Value key, Value value) {
+    key = canonicalKey(key);
+    uint32_t hash = hashKey(key);
+    if (map->count > 0) {
+        int32_t slot = *findSlot(map, key, hash);
+        if (slot >= 0) {
+            map->entries[slot].value = value;
+            return false;
+        }
+    }
+
+    if (map->entryCount == map->entryCapacity) {
+        // Only grow if dropping the removed entries wouldn't leave at least half of the entries free.
+        int slotCapacity = map->slotCapacity > 0 ? map->slotCapacity : MAP_MIN_CAPACITY;
+        if (map->count + 1 > entryCapacityFor(slotCapacity) / 2) {
+            slotCapacity *= 2;
+        }
+        rebuildMap(map, slotCapacity);
+    }
+
+    int index = map->entryCount++;
+    MapEntry* entry = &map->entries[index];
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+    entry->removed = false;
+    *findSlot(map, key, hash) = index;
+    ++map->count;
+    return true;
+}
+
+bool mapRemove(Map* map, Value key) {
+    if (map->count == 0) {
+        return false;
+    }
+
+    key = canonicalKey(key);
+    int32_t* slot = findSlot(map, key, hashKey(key));
+    if (*slot < 0) {
+        return false;
+    }
+
+    MapEntry* entry = &map->entries[*slot];
+    entry->removed = true;
+    // Lets the key and value be collected before the map is rebuilt.
+    entry->key = NIL_VAL;
+    entry->value = NIL_VAL;
+    *slot = SLOT_REMOVED;
+    --map->count;
+    return true;
+}
+
+void markMap(Map* map) {
+    for (int i = 0; i < map->entryCount; ++i) {
+        MapEntry* entry = &map->entries[i];
+        if (!entry->removed) {
+            markValue(entry->key);
+            markValue(entry->value);
+        }
+    }
+}
+
+void relocateMap(Map* map) {
+    bool rehash = false;
+    for (int i = 0; i < map->entryCount; ++i) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->removed) {
+            continue;
+        }
+        Value key = entry->key;
+        relocateValue(&entry->key);
+        relocateValue(&entry->value);
+        // Strings are hashed by content, but other objects' hashes change along with their addresses. The old address
+        // only holds a forwarding pointer, so it is compared without being looked at.
+        if (IS_OBJ(key) && AS_OBJ(key) != AS_OBJ(entry->key) && !IS_STRING(entry->key)) {
+            entry->hash = hashKey(entry->key);
+            rehash = true;
+        }
+    }
+    if (rehash) {
+        fillSlots(map);
+    }
+}
@@ -1,4 +1,7 @@
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "../include/compiler.h"
 #include "../include/memory.h"
@@ -6,27 +9,101 @@
 #include "../include/vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
-
 #include "../include/debug.h"
-
 #endif
-#ifdef DEBUG_PRINT
-#include <stdio.h>
+
+/// @brief Fraction of unused small-object slots at which a collection schedules a compaction.
+#define GC_COMPACT_FRAGMENTATION 0.5
+/// @brief Heaps with fewer occupied size-class pages than this are never compacted.
+#define GC_COMPACT_MIN_PAGES 16
+/// @brief Pages less occupied than this are evacuated by a compaction.
+#ifdef DEBUG_STRESS_COMPACTION
+#define GC_EVACUATE_OCCUPANCY 1.01
+#else
+#define GC_EVACUATE_OCCUPANCY 0.5
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+void initGCPolicy(GCPolicy* policy) {
+    policy->initialHeapSize = 1024 * 1024;
+    policy->growthFactor = 2.0;
+    policy->minHeapSize = 0;
+    policy->maxHeapSize = 0;
+    policy->softLimit = 0;
+    policy->nextThreshold = defaultNextThreshold;
+}
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
-    if (newSize > oldSize) {
+size_t defaultNextThreshold(const GCPolicy* policy, size_t liveBytes) {
+    size_t headroom = (size_t)(liveBytes * (policy->growthFactor - 1.0));
+    if (policy->softLimit != 0 && liveBytes + headroom > policy->softLimit) {
+        // Past the soft limit, collect as soon as a quarter of the usual headroom has been used.
+        headroom = liveBytes < policy->softLimit ? policy->softLimit - liveBytes : headroom / 4;
+    }
+
+    size_t threshold = liveBytes + headroom;
+    if (threshold < policy->minHeapSize) {
+        threshold = policy->minHeapSize;
+    }
+    if (policy->maxHeapSize != 0 && threshold > policy->maxHeapSize) {
+        threshold = policy->maxHeapSize;
+    }
+    return threshold;
+}
+
+void setGCPolicy(const GCPolicy* policy) {
+    vm.gcPolicy = *policy;
+    vm.nextGC = policy->initialHeapSize;
+    if (policy->maxHeapSize != 0 && vm.nextGC > policy->maxHeapSize) {
+        vm.nextGC = policy->maxHeapSize;
+    }
+}
+
+/// @brief Gives up on an allocation, unwinding to the running interpreter as a runtime error if there is one.
+static void heapExhausted() {
+    if (vm.allocationFailure != NULL) {
+        longjmp(*vm.allocationFailure, 1);
+    }
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+}
+
+/// @brief Collects garbage if the heap is about to grow past the GC threshold, and enforces the policy's hard limit.
+static void reserveHeap(size_t bytes) {
+    if (vm.collecting) {
+        return;
+    }
+
+    bool collected = false;
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+    collectGarbage();
+    collected = true;
 #endif
-        if (vm.bytesAllocated > vm.nextGC) {
+    if (!collected && vm.bytesAllocated + bytes > vm.nextGC) {
+        collectGarbage();
+        collected = true;
+    }
+
+    // Only running code is held to the hard limit. Compiling allocates in proportion to the source rather than to what
+    // the program builds, and failing there would leave the REPL unable to compile the statement that frees memory.
+    size_t limit = vm.gcPolicy.maxHeapSize;
+    if (limit != 0 && vm.allocationFailure != NULL && vm.bytesAllocated + bytes > limit) {
+        if (!collected) {
             collectGarbage();
         }
+        if (vm.bytesAllocated + bytes > limit) {
+            heapExhausted();
+        }
+    }
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize > oldSize) {
+        reserveHeap(newSize - oldSize);
+        vm.gcStats.bytesAllocated += newSize - oldSize;
+    }
+    else {
+        vm.gcStats.bytesFreed += oldSize - newSize;
     }
+    vm.bytesAllocated += newSize - oldSize;
 
     if (newSize == 0) {
         free(pointer);
@@ -35,14 +112,30 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 
     void* result = realloc(pointer, newSize);
     if (result == NULL) {
-        exit(1);
+        // Give the system allocator back whatever garbage is holding on to before failing.
+        collectGarbage();
+        result = realloc(pointer, newSize);
+        if (result == NULL) {
+            vm.bytesAllocated -= newSize - oldSize;
+            vm.gcStats.bytesAllocated -= newSize - oldSize;
+            heapExhausted();
+        }
     }
 
     return result;
 }
 
+void* allocateObjectMemory(size_t size) {
+    size_t bytes = heapAllocationSize(size);
+    reserveHeap(bytes);
+    vm.bytesAllocated += bytes;
+    vm.gcStats.bytesAllocated += bytes;
+
+    return heapAllocate(&vm.heap, size);
+}
+
 void markObject(Obj* object) {
-    if (object == NULL || object->isMarked) {
+    if (object == NULL || isMarked(object)) {
         return;
     }
 #ifdef DEBUG_LOG_GC
@@ -51,7 +144,7 @@ void markObject(Obj* object) {
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    setMarked(object);
 
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -81,7 +174,7 @@ static void blackenObject(Obj* object) {
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    switch (object->type) {
+    switch (objType(object)) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
             markValue(bound->receiver);
@@ -91,7 +184,11 @@ static void blackenObject(Obj* object) {
         case OBJ_CLASS: {
             ObjClass* loxClass = (ObjClass*)object;
             markObject((Obj*)loxClass->name);
-            markTable(&loxClass->methods);
+            markObject((Obj*)loxClass->initializer);
+            for (int i = 0; i < loxClass->methodCount; ++i) {
+                markObject((Obj*)loxClass->methods[i]);
+            }
+            markTable(&loxClass->sparseMethods);
             break;
         }
         case OBJ_CLOSURE: {
@@ -114,58 +211,81 @@ static void blackenObject(Obj* object) {
             markTable(&instance->fields);
             break;
         }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            for (int i = 0; i < list->count; ++i) {
+                markValue(list->items[i]);
+            }
+            break;
+        }
+        case OBJ_MAP:
+            markMap(&((ObjMap*)object)->map);
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            break;
+        }
+        case OBJ_STRING:
+            if (object->header & STRING_FLAG_SLICE) {
+                markObject(((ObjSlice*)object)->owner);
+            }
+            break;
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
             break;
-        case OBJ_STRING:
+        case OBJ_FLOAT64_ARRAY:
         case OBJ_NATIVE:
             break;
     }
 }
 
-/// @brief Frees an object and any of its members that need freeing.
+/// @brief Frees the memory an object owns. The object's own slot is reclaimed by the heap.
 static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
+    printf("%p free type %d\n", (void*)object, objType(object));
 #endif
-    switch (object->type) {
-        case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
-            break;
+    ++vm.gcStats.objectsFreed[objType(object)];
+    switch (objType(object)) {
         case OBJ_CLASS: {
             ObjClass* loxClass = (ObjClass*)object;
-            freeTable(&loxClass->methods);
-            FREE(ObjClass, object);
+            FREE_ARRAY(ObjClosure*, loxClass->methods, loxClass->methodCount);
+            freeTable(&loxClass->sparseMethods);
             break;
         }
-        case OBJ_CLOSURE:
-            ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array* array = (ObjFloat64Array*)object;
+            // An array whose storage couldn't be allocated has none.
+            if (array->storage != NULL) {
+                FREE_ARRAY(char, array->storage, FLOAT64_ARRAY_STORAGE_SIZE(array->length));
+            }
             break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             freeTable(&instance->fields);
-            FREE(ObjInstance, object);
             break;
         }
-        case OBJ_NATIVE:
-            FREE(ObjNative, object);
-            break;
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            FREE_ARRAY(Value, list->items, list->capacity);
             break;
         }
+        case OBJ_MAP:
+            freeMap(&((ObjMap*)object)->map);
+            break;
+        case OBJ_BOUND_METHOD:
+        case OBJ_CLOSURE:
+        case OBJ_NATIVE:
+        case OBJ_ROPE:
+        case OBJ_STRING:
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
             break;
     }
 }
@@ -183,10 +303,10 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    printTable(&vm.globals);
     markTable(&vm.globals);
+    markTable(&vm.selectors);
+    markArray(&vm.selectorNames);
     markCompilerRoots();
-    markObject((Obj*)vm.initString);
 }
 
 /// @brief GC-marks gray objects' references, i.e. marks indirectly reachable objects.
@@ -199,26 +319,30 @@ void traceReferences() {
 
 /// @brief Frees unmarked objects.
 void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        }
-        else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            }
-            else {
-                vm.objects = object;
-            }
-            freeObject(unreached);
-        }
+    size_t freed = sweepHeap(&vm.heap, freeObject);
+    vm.bytesAllocated -= freed;
+    vm.gcStats.bytesFreed += freed;
+}
+
+/// @returns A timestamp in nanoseconds for measuring GC pauses.
+static uint64_t nanoTime() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/// @brief Adds a GC pause of the given length to the statistics.
+static void recordPause(uint64_t nanos) {
+    vm.gcStats.pauseTotalNanos += nanos;
+    if (nanos > vm.gcStats.pauseMaxNanos) {
+        vm.gcStats.pauseMaxNanos = nanos;
     }
+
+    int bucket = 0;
+    for (uint64_t micros = nanos / 1000; micros > 0 && bucket < GC_PAUSE_BUCKETS - 1; micros >>= 1) {
+        ++bucket;
+    }
+    ++vm.gcStats.pauseHistogram[bucket];
 }
 
 void collectGarbage() {
@@ -226,14 +350,31 @@ void collectGarbage() {
     printf("-- gc begin\n");
     size_t before = vm.bytesAllocated;
 #endif
+    uint64_t start = nanoTime();
+    vm.collecting = true;
 
     markRoots();
     traceReferences();
     // Prevent dangling pointers
     tableRemoveWhite(&vm.strings);
     sweep();
+    // A burst of temporary strings would otherwise leave the intern table large and full of deleted slots for good.
+    tableCompact(&vm.strings);
+
+    vm.collecting = false;
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm.nextGC = vm.gcPolicy.nextThreshold(&vm.gcPolicy, vm.bytesAllocated);
+    ++vm.gcStats.collections;
+    vm.gcStats.liveBytesAfterGC = vm.bytesAllocated;
+
+#ifdef GC_COMPACTION
+#ifdef DEBUG_STRESS_COMPACTION
+    vm.compactionPending = true;
+#else
+    vm.compactionPending = heapOccupiedPageCount(&vm.heap) >= GC_COMPACT_MIN_PAGES && heapFragmentation(&vm.heap) > GC_COMPACT_FRAGMENTATION;
+#endif
+#endif
+    recordPause(nanoTime() - start);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -241,12 +382,258 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+/// @brief Updates an object pointer after compaction has moved objects.
+#define RELOCATE(type, pointer) ((pointer) = (type*)forwardingAddress((Obj*)(pointer)))
+
+void relocateValue(Value* value) {
+    Value current = *value;
+    if (IS_OBJ(current)) {
+        *value = OBJ_VAL(forwardingAddress(AS_OBJ(current)));
+    }
+}
+/// @brief Updates the object references in a ValueArray after compaction.
+static void relocateArray(ValueArray* array) {
+    for (int i = 0; i < array->count; ++i) {
+        relocateValue(&array->values[i]);
+    }
+}
+
+/// @brief Updates all of an object's references to objects that compaction has moved.
+static void relocateReferences(Obj* object) {
+    switch (objType(object)) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            relocateValue(&bound->receiver);
+            RELOCATE(ObjClosure, bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* loxClass = (ObjClass*)object;
+            RELOCATE(ObjString, loxClass->name);
+            RELOCATE(ObjClosure, loxClass->initializer);
+            for (int i = 0; i < loxClass->methodCount; ++i) {
+                RELOCATE(ObjClosure, loxClass->methods[i]);
+            }
+            relocateTable(&loxClass->sparseMethods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            RELOCATE(ObjFunction, closure->function);
+            for (int i = 0; i < closure->upvalueCount; ++i) {
+                RELOCATE(ObjUpvalue, closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            RELOCATE(ObjString, function->name);
+            relocateArray(&function->chunk.constants);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            RELOCATE(ObjClass, instance->loxClass);
+            tableMoveInline(&instance->fields, instance->inlineFields);
+            relocateTable(&instance->fields);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            for (int i = 0; i < list->count; ++i) {
+                relocateValue(&list->items[i]);
+            }
+            break;
+        }
+        case OBJ_MAP:
+            relocateMap(&((ObjMap*)object)->map);
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            RELOCATE(Obj, rope->left);
+            RELOCATE(Obj, rope->right);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            relocateValue(&upvalue->closed);
+            RELOCATE(ObjUpvalue, upvalue->next);
+            // A closed upvalue points at its own closed field, which may have moved with it.
+            if (upvalue->location < vm.stack || upvalue->location >= vm.stack + STACK_MAX) {
+                upvalue->location = &upvalue->closed;
+            }
+            break;
+        }
+        case OBJ_STRING:
+            if (object->header & STRING_FLAG_SLICE) {
+                ObjSlice* slice = (ObjSlice*)object;
+                Obj* owner = forwardingAddress(slice->owner);
+                // The characters are at the same offset in the moved owner.
+                slice->start = (const char*)owner + (slice->start - (const char*)slice->owner);
+                slice->owner = owner;
+            }
+            break;
+        case OBJ_FLOAT64_ARRAY:
+        case OBJ_NATIVE:
+            break;
     }
+}
+
+/// @brief Updates the roots' references to objects that compaction has moved.
+static void relocateRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; ++slot) {
+        relocateValue(slot);
+    }
+
+    for (int i = 0; i < vm.frameCount; ++i) {
+        RELOCATE(ObjClosure, vm.frames[i].closure);
+    }
+
+    RELOCATE(ObjUpvalue, vm.openUpvalues);
+    relocateTable(&vm.globals);
+    relocateTable(&vm.strings);
+    relocateTable(&vm.selectors);
+    relocateArray(&vm.selectorNames);
+}
+
+void compactHeap() {
+    collectGarbage();
+    vm.compactionPending = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compaction begin\n");
+    int pagesBefore = vm.heap.pageCount;
+#endif
+    uint64_t start = nanoTime();
+
+    // After the sweep every allocated slot holds a live object.
+    int moved = evacuateHeap(&vm.heap, GC_EVACUATE_OCCUPANCY);
+    if (moved > 0) {
+        relocateRoots();
+        walkHeap(&vm.heap, relocateReferences);
+    }
+    releaseEvacuatedPages(&vm.heap);
+    ++vm.gcStats.compactions;
+    recordPause(nanoTime() - start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compaction end\n");
+    printf("   moved %d objects (from %d to %d pages)\n", moved, pagesBefore, vm.heap.pageCount);
+#endif
+}
+
+/// @brief Adds the sizes of an object's tables to their roles' statistics.
+static void sampleObjectTables(Obj* object) {
+    switch (objType(object)) {
+        case OBJ_INSTANCE:
+            sampleTableStats(&((ObjInstance*)object)->fields);
+            break;
+        case OBJ_CLASS:
+            sampleTableStats(&((ObjClass*)object)->sparseMethods);
+            break;
+        default:
+            break;
+    }
+}
+
+void printTableStats() {
+    for (int role = 0; role < TABLE_ROLE_COUNT; ++role) {
+        TableStats* stats = tableStats((TableRole)role);
+        stats->tables = 0;
+        stats->capacity = 0;
+        stats->count = 0;
+        stats->tombstones = 0;
+    }
+    sampleTableStats(&vm.globals);
+    sampleTableStats(&vm.strings);
+    sampleTableStats(&vm.selectors);
+    walkHeap(&vm.heap, sampleObjectTables);
+
+    fprintf(stderr, "== table stats ==\n");
+    fprintf(stderr, "%-9s %12s %8s %10s %10s %9s %7s %7s %8s %7s %8s %10s %10s\n", "role", "lookups", "hit %", "avg group",
+            "avg keys", "max group", "grows", "shrinks", "rehashes", "tables", "entries", "load", "tombstones");
+    for (int role = 0; role < TABLE_ROLE_COUNT; ++role) {
+        TableStats* stats = tableStats((TableRole)role);
+        double lookups = stats->lookups > 0 ? (double)stats->lookups : 1.0;
+        double capacity = stats->capacity > 0 ? (double)stats->capacity : 1.0;
+        fprintf(stderr, "%-9s %12llu %7.1f%% %10.3f %10.3f %9d %7llu %7llu %8llu %7d %8zu %9.1f%% %9.1f%%\n",
+                tableRoleName((TableRole)role), (unsigned long long)stats->lookups, 100.0 * stats->hits / lookups,
+                stats->groupsProbed / lookups, stats->keyCompares / lookups, stats->maxGroupsProbed,
+                (unsigned long long)stats->grows, (unsigned long long)stats->shrinks, (unsigned long long)stats->rehashes,
+                stats->tables, stats->count, 100.0 * stats->count / capacity, 100.0 * stats->tombstones / capacity);
+    }
+}
+
+const char* objTypeName(ObjType type) {
+    switch (type) {
+        case OBJ_BOUND_METHOD:
+            return "bound method";
+        case OBJ_CLASS:
+            return "class";
+        case OBJ_CLOSURE:
+            return "closure";
+        case OBJ_FLOAT64_ARRAY:
+            return "float64 array";
+        case OBJ_FUNCTION:
+            return "function";
+        case OBJ_INSTANCE:
+            return "instance";
+        case OBJ_LIST:
+            return "list";
+        case OBJ_MAP:
+            return "map";
+        case OBJ_NATIVE:
+            return "native";
+        case OBJ_ROPE:
+            return "rope";
+        case OBJ_STRING:
+            return "string";
+        case OBJ_UPVALUE:
+            return "upvalue";
+    }
+    return "unknown";
+}
+
+void getGCStats(GCStats* stats) {
+    *stats = vm.gcStats;
+}
+
+void printGCStats() {
+    GCStats* stats = &vm.gcStats;
+    fprintf(stderr, "== gc stats ==\n");
+    fprintf(stderr, "collections          %llu\n", (unsigned long long)stats->collections);
+    fprintf(stderr, "compactions          %llu\n", (unsigned long long)stats->compactions);
+    fprintf(stderr, "bytes allocated      %llu\n", (unsigned long long)stats->bytesAllocated);
+    fprintf(stderr, "bytes freed          %llu\n", (unsigned long long)stats->bytesFreed);
+    fprintf(stderr, "heap bytes           %zu\n", vm.bytesAllocated);
+    fprintf(stderr, "live bytes after gc  %zu\n", stats->liveBytesAfterGC);
+    fprintf(stderr, "heap pages           %d\n", vm.heap.pageCount);
+    fprintf(stderr, "pause total          %.3f ms\n", stats->pauseTotalNanos / 1e6);
+    fprintf(stderr, "pause max            %.3f ms\n", stats->pauseMaxNanos / 1e6);
+
+    fprintf(stderr, "%-20s %12s %12s %12s\n", "objects", "allocated", "freed", "live");
+    for (int type = 0; type < OBJ_TYPE_COUNT; ++type) {
+        uint64_t allocated = stats->objectsAllocated[type];
+        uint64_t freed = stats->objectsFreed[type];
+        fprintf(stderr, "  %-18s %12llu %12llu %12llu\n", objTypeName((ObjType)type), (unsigned long long)allocated,
+                (unsigned long long)freed, (unsigned long long)(allocated - freed));
+    }
+
+    fprintf(stderr, "pause histogram\n");
+    for (int bucket = 0; bucket < GC_PAUSE_BUCKETS; ++bucket) {
+        if (stats->pauseHistogram[bucket] == 0) {
+            continue;
+        }
+        if (bucket == GC_PAUSE_BUCKETS - 1) {
+            fprintf(stderr, "  >= %8llu us %10llu\n", 1ull << (bucket - 1), (unsigned long long)stats->pauseHistogram[bucket]);
+        }
+        else {
+            fprintf(stderr, "  <  %8llu us %10llu\n", 1ull << bucket, (unsigned long long)stats->pauseHistogram[bucket]);
+        }
+    }
+}
+
+void freeObjects() {
+    freeHeap(&vm.heap, freeObject);
     free(vm.grayStack);
 }
\ No newline at end of file
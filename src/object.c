@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../include/allocator.h"
 #include "../include/memory.h"
 #include "../include/object.h"
 #include "../include/table.h"
@@ -9,14 +11,15 @@
 /// @brief Allocates an object on the heap, a sort of constructor.
 /// @returns An Obj* to the allocated object.
 #define ALLOCATE_OBJ(type, objectType) ((type*)allocateObject(sizeof(type), objectType))
+/// @brief Allocates an object that ends in a flexible array of count elements.
+#define ALLOCATE_FLEX_OBJ(type, elementType, count, objectType) \
+    ((type*)allocateObject(sizeof(type) + sizeof(elementType) * (count), objectType))
 
 /// @brief Allocates an object on the heap.
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = reallocate(NULL, 0, size);
-    object->type = type;
-    object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    Obj* object = (Obj*)allocateObjectMemory(size);
+    object->header = (uint32_t)type;
+    ++vm.gcStats.objectsAllocated[type];
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -34,75 +37,263 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
 ObjClass* newClass(ObjString* name) {
     ObjClass* loxClass = (ObjClass*)ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     loxClass->name = name;
-    initTable(&loxClass->methods);
+    loxClass->initializer = NULL;
+    loxClass->methods = NULL;
+    loxClass->methodCount = 0;
+    initTable(&loxClass->sparseMethods, TABLE_METHODS);
+    loxClass->instanceCount = 0;
+    loxClass->fieldCount = 0;
     return loxClass;
 }
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; ++i) {
-        upvalues[i] = NULL;
-    }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = ALLOCATE_FLEX_OBJ(ObjClosure, ObjUpvalue*, function->upvalueCount, OBJ_CLOSURE);
     closure->function = function;
-
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; ++i) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
+ObjFloat64Array* newFloat64Array(int length) {
+    // Like a list, the array is allocated without storage first, so that running out of memory can't lose the storage.
+    ObjFloat64Array* array = ALLOCATE_OBJ(ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+    array->length = 0;
+    array->storage = NULL;
+    array->data = NULL;
+    push(OBJ_VAL(array));
+    void* storage = ALLOCATE(char, FLOAT64_ARRAY_STORAGE_SIZE(length));
+    pop();
+    array->length = length;
+    array->storage = storage;
+    array->data = (double*)(((uintptr_t)storage + KERNEL_ALIGNMENT - 1) & ~(uintptr_t)(KERNEL_ALIGNMENT - 1));
+    memset(array->data, 0, sizeof(double) * (size_t)length);
+    return array;
+}
 ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->stackSize = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
 }
 ObjInstance* newInstance(ObjClass* loxClass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int capacity = 0;
+    if (loxClass->instanceCount <= SLACK_TRACKING_INSTANCES) {
+        ++loxClass->instanceCount;
+    }
+    if (loxClass->instanceCount > SLACK_TRACKING_INSTANCES && loxClass->fieldCount > 0) {
+        capacity = tableCapacityFor(loxClass->fieldCount);
+        // Instances too large for a size class would waste most of a page; they grow their table on their own.
+        if (sizeof(ObjInstance) + tableInlineSize(capacity) > SMALL_OBJECT_MAX) {
+            capacity = 0;
+        }
+    }
+
+    size_t inlineSize = capacity > 0 ? tableInlineSize(capacity) : 0;
+    ObjInstance* instance = (ObjInstance*)allocateObject(sizeof(ObjInstance) + inlineSize, OBJ_INSTANCE);
     instance->loxClass = loxClass;
-    initTable(&instance->fields);
+    if (capacity > 0) {
+        initTableInline(&instance->fields, TABLE_FIELDS, capacity, instance->inlineFields);
+    }
+    else {
+        initTable(&instance->fields, TABLE_FIELDS);
+    }
     return instance;
 }
+ObjList* newList(Value* items, int count) {
+    // The list is allocated empty before its storage, so that the storage can't be lost if allocating the list runs
+    // out of memory, and a collection while the storage is allocated sees a valid list.
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    if (count > 0) {
+        push(OBJ_VAL(list));
+        list->items = ALLOCATE(Value, count);
+        pop();
+        memcpy(list->items, items, sizeof(Value) * count);
+        list->count = count;
+        list->capacity = count;
+    }
+    return list;
+}
+void listAppend(ObjList* list, Value value) {
+    if (list->count == list->capacity) {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->items = GROW_ARRAY(Value, list->items, oldCapacity, list->capacity);
+    }
+    list->items[list->count++] = value;
+}
+void listAppendAll(ObjList* list, Value* items, int count) {
+    if (list->count + count > list->capacity) {
+        int oldCapacity = list->capacity;
+        list->capacity = list->count + count;
+        list->items = GROW_ARRAY(Value, list->items, oldCapacity, list->capacity);
+    }
+    memcpy(list->items + list->count, items, sizeof(Value) * count);
+    list->count += count;
+}
+ObjMap* newMap() {
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initMap(&map->map);
+    return map;
+}
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-/// @brief Allocates a string object on the heap.
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+/// @brief Adds a hashed string to the VM's table of interned strings.
+static void addInternedString(ObjString* string) {
+    string->obj.header |= STRING_FLAG_HASHED | STRING_FLAG_INTERNED;
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
+}
+
+/// @brief Constants of the string hash, from wyhash.
+static const uint64_t HASH_SECRET[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+/// @brief Multiplies two words into a 128-bit product.
+/// @returns The product's high word, with the low word stored in low.
+static inline uint64_t multiplyWide(uint64_t a, uint64_t b, uint64_t* low) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    *low = (uint64_t)product;
+    return (uint64_t)(product >> 64);
+#else
+    uint64_t aHigh = a >> 32, aLow = (uint32_t)a, bHigh = b >> 32, bLow = (uint32_t)b;
+    uint64_t lowLow = aLow * bLow, highLow = aHigh * bLow, lowHigh = aLow * bHigh, highHigh = aHigh * bHigh;
+    uint64_t middle = (lowLow >> 32) + (uint32_t)highLow + (uint32_t)lowHigh;
+    *low = (middle << 32) | (uint32_t)lowLow;
+    return highHigh + (highLow >> 32) + (lowHigh >> 32) + (middle >> 32);
+#endif
+}
+/// @returns The two halves of the 128-bit product of a and b, xored together.
+static inline uint64_t mixWords(uint64_t a, uint64_t b) {
+    uint64_t low;
+    uint64_t high = multiplyWide(a, b, &low);
+    return low ^ high;
+}
+/// @brief Reads 8 unaligned bytes.
+static inline uint64_t read64(const char* chars) {
+    uint64_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+/// @brief Reads 4 unaligned bytes.
+static inline uint64_t read32(const char* chars) {
+    uint32_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+
+uint32_t hashString(const char* key, int length) {
+    const char* p = key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = mixWords(HASH_SECRET[0], HASH_SECRET[1]);
+    uint64_t a;
+    uint64_t b;
+
+    if (remaining <= 16) {
+        // Short strings are read as up to four overlapping 4-byte words.
+        if (remaining >= 4) {
+            size_t offset = (remaining >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + offset);
+            b = (read32(p + remaining - 4) << 32) | read32(p + remaining - 4 - offset);
+        }
+        else if (remaining > 0) {
+            a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[remaining >> 1] << 8) | (uint8_t)p[remaining - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        if (remaining > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = mixWords(read64(p) ^ HASH_SECRET[1], read64(p + 8) ^ seed);
+                seed1 = mixWords(read64(p + 16) ^ HASH_SECRET[2], read64(p + 24) ^ seed1);
+                seed2 = mixWords(read64(p + 32) ^ HASH_SECRET[3], read64(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16) {
+            seed = mixWords(read64(p) ^ HASH_SECRET[1], read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    a ^= HASH_SECRET[1];
+    b ^= seed;
+    b = multiplyWide(a, b, &a);
+    uint64_t hash = mixWords(a ^ HASH_SECRET[0] ^ (uint64_t)length, b ^ HASH_SECRET[1]);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+ObjString* newString(int length) {
+    ObjString* string = ALLOCATE_FLEX_OBJ(ObjString, char, length + 1, OBJ_STRING);
+    string->hash = 0;
+    string->length = length;
+    string->chars[length] = '\0';
     return string;
 }
 
-/// @brief Uses the FNV-1a algorithm.
-/// @returns The hash of the given string.
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; ++i) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+uint32_t stringHash(ObjString* string) {
+    if (!(string->obj.header & STRING_FLAG_HASHED)) {
+        string->hash = hashString(stringChars(string), string->length);
+        string->obj.header |= STRING_FLAG_HASHED;
     }
-    return hash;
+    return string->hash;
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+ObjString* internString(ObjString* string) {
+    if (string->obj.header & STRING_FLAG_INTERNED) {
+        return string;
+    }
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    // An equal string that already exists wins; this one is left for the GC.
+    ObjString* interned = tableFindString(&vm.strings, stringChars(string), string->length, stringHash(string));
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    addInternedString(string);
+    return string;
+}
+
+bool stringsEqual(Obj* a, Obj* b) {
+    if (a == b) {
+        return true;
+    }
+    if (stringLength(a) != stringLength(b)) {
+        return false;
+    }
+
+    ObjString* aString = objType(a) == OBJ_ROPE ? flattenRope((ObjRope*)a) : (ObjString*)a;
+    ObjString* bString = objType(b) == OBJ_ROPE ? flattenRope((ObjRope*)b) : (ObjString*)b;
+    if (aString == bString) {
+        return true;
+    }
+    if (aString->obj.header & bString->obj.header & STRING_FLAG_INTERNED) {
+        return false;
+    }
+    if ((aString->obj.header & bString->obj.header & STRING_FLAG_HASHED) && aString->hash != bString->hash) {
+        return false;
+    }
+    return memcmp(stringChars(aString), stringChars(bString), aString->length) == 0;
 }
 
 ObjString* copyString(const char* chars, int length) {
@@ -113,10 +304,95 @@ ObjString* copyString(const char* chars, int length) {
         return interned;
     }
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = newString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    addInternedString(string);
+    return string;
+}
+
+ObjString* sliceString(ObjString* parent, const char* chars, int length) {
+    const char* parentChars = stringChars(parent);
+    if (length < SLICE_MIN_LENGTH || chars < parentChars || chars + length > parentChars + parent->length) {
+        return copyString(chars, length);
+    }
+
+    uint32_t hash = hashString(chars, length);
+    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL) {
+        return interned;
+    }
+
+    // Slices of slices reference the original owner directly.
+    Obj* owner = (parent->obj.header & STRING_FLAG_SLICE) ? ((ObjSlice*)parent)->owner : (Obj*)parent;
+    ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_STRING);
+    slice->obj.header |= STRING_FLAG_SLICE;
+    slice->hash = hash;
+    slice->length = length;
+    slice->owner = owner;
+    slice->start = chars;
+    addInternedString((ObjString*)slice);
+    return (ObjString*)slice;
+}
+
+int stringLength(Obj* string) {
+    if (objType(string) == OBJ_ROPE) {
+        return ((ObjRope*)string)->length;
+    }
+    return ((ObjString*)string)->length;
+}
+
+ObjRope* newRope(Obj* left, Obj* right) {
+    // A side that has been flattened is replaced by its flat string, so that the old rope can be collected.
+    if (objType(left) == OBJ_ROPE && ((ObjRope*)left)->right == NULL) {
+        left = ((ObjRope*)left)->left;
+    }
+    if (objType(right) == OBJ_ROPE && ((ObjRope*)right)->right == NULL) {
+        right = ((ObjRope*)right)->left;
+    }
+
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = stringLength(left) + stringLength(right);
+    rope->left = left;
+    rope->right = right;
+    return rope;
+}
+
+void copyStringChars(Obj* string, char* dest) {
+    // Recursing into the shorter side only keeps the recursion depth logarithmic in the length.
+    while (objType(string) == OBJ_ROPE) {
+        ObjRope* rope = (ObjRope*)string;
+        if (rope->right == NULL) {
+            string = rope->left;
+            break;
+        }
+
+        int leftLength = stringLength(rope->left);
+        if (leftLength <= rope->length - leftLength) {
+            copyStringChars(rope->left, dest);
+            dest += leftLength;
+            string = rope->right;
+        }
+        else {
+            copyStringChars(rope->right, dest + leftLength);
+            string = rope->left;
+        }
+    }
+    memcpy(dest, stringChars((ObjString*)string), ((ObjString*)string)->length);
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->right == NULL) {
+        return (ObjString*)rope->left;
+    }
+
+    ObjString* string = newString(rope->length);
+    copyStringChars((Obj*)rope, string->chars);
+
+    // The pieces are no longer needed and become garbage unless something else holds them.
+    rope->left = (Obj*)string;
+    rope->right = NULL;
+    return string;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -127,13 +403,41 @@ ObjUpvalue* newUpvalue(Value* slot) {
     return upvalue;
 }
 
+/// @brief How many containers can be nested while printing before the rest are elided.
+#define PRINT_DEPTH_MAX 64
+
+/// @brief The containers currently being printed, outermost first.
+static Obj* printing[PRINT_DEPTH_MAX];
+static int printingCount = 0;
+
+/// @brief Pushes a container onto the stack of containers being printed.
+/// @returns false if the container is already being printed (a cycle) or nesting is too deep, in which case nothing
+/// is pushed and the caller should elide its contents.
+static bool beginPrinting(Obj* object) {
+    if (printingCount == PRINT_DEPTH_MAX) {
+        return false;
+    }
+    for (int i = 0; i < printingCount; ++i) {
+        if (printing[i] == object) {
+            return false;
+        }
+    }
+    printing[printingCount++] = object;
+    return true;
+}
+
+/// @brief Pops the container pushed by the matching beginPrinting.
+static void endPrinting() {
+    --printingCount;
+}
+
 /// @brief Prints the function (its name).
 static void printFunction(ObjFunction* function) {
     if (function->name == NULL) {
         printf("<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    printf("<fn %.*s>", function->name->length, stringChars(function->name));
 }
 
 void printObject(Value value) {
@@ -142,22 +446,93 @@ void printObject(Value value) {
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
         case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
+            printf("%.*s", AS_CLASS(value)->name->length, stringChars(AS_CLASS(value)->name));
             break;
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array* array = AS_FLOAT64_ARRAY(value);
+            printf("Float64Array[");
+            for (int i = 0; i < array->length; ++i) {
+                if (i > 0) {
+                    printf(", ");
+                }
+                printValue(NUMBER_VAL(array->data[i]));
+            }
+            printf("]");
+            break;
+        }
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->loxClass->name->chars);
+            printf("%.*s instance", AS_INSTANCE(value)->loxClass->name->length, stringChars(AS_INSTANCE(value)->loxClass->name));
+            break;
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            if (!beginPrinting((Obj*)list)) {
+                printf("[...]");
+                break;
+            }
+            printf("[");
+            for (int i = 0; i < list->count; ++i) {
+                if (i > 0) {
+                    printf(", ");
+                }
+                printValue(list->items[i]);
+            }
+            printf("]");
+            endPrinting();
             break;
+        }
+        case OBJ_MAP: {
+            if (!beginPrinting(AS_OBJ(value))) {
+                printf("{...}");
+                break;
+            }
+            Map* map = &AS_MAP(value)->map;
+            printf("{");
+            bool first = true;
+            for (int i = 0; i < map->entryCount; ++i) {
+                MapEntry* entry = &map->entries[i];
+                if (entry->removed) {
+                    continue;
+                }
+                if (!first) {
+                    printf(", ");
+                }
+                first = false;
+                printValue(entry->key);
+                printf(": ");
+                printValue(entry->value);
+            }
+            printf("}");
+            endPrinting();
+            break;
+        }
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_ROPE: {
+            ObjRope* rope = AS_ROPE(value);
+            if (rope->right == NULL) {
+                printf("%.*s", rope->length, stringChars((ObjString*)rope->left));
+                break;
+            }
+            // Flattening allocates, which isn't allowed everywhere this is called (e.g. while tracing the GC), so the
+            // characters are copied to a temporary buffer instead.
+            char* chars = (char*)malloc(rope->length);
+            if (chars == NULL) {
+                exit(1);
+            }
+            copyStringChars((Obj*)rope, chars);
+            fwrite(chars, 1, rope->length, stdout);
+            free(chars);
+            break;
+        }
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            printf("%.*s", AS_STRING(value)->length, stringChars(AS_STRING(value)));
             break;
         case OBJ_UPVALUE:
             // Will never run
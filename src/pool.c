@@ -0,0 +1,176 @@
+#include "../include/pool.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+/// @brief The worker threads and the job they are running. Everything but the next chunk is guarded by the mutex.
+static struct {
+    int threadCount;
+    pthread_t workers[POOL_MAX_THREADS];
+    int workerCount;
+    pthread_mutex_t mutex;
+    // Signaled when a job is handed out or the workers are stopped.
+    pthread_cond_t workAvailable;
+    // Signaled when the last worker leaves a job.
+    pthread_cond_t workDone;
+    bool stopping;
+
+    // Incremented for every job, so that a worker can tell a new one from the one it last ran.
+    uint64_t generation;
+    ChunkFn fn;
+    void* context;
+    int chunkCount;
+    atomic_int nextChunk;
+    // Workers that took the current job and haven't finished their chunks yet.
+    int activeWorkers;
+} pool = {
+    .threadCount = 1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .workAvailable = PTHREAD_COND_INITIALIZER,
+    .workDone = PTHREAD_COND_INITIALIZER,
+};
+
+/// @brief Runs chunks of the current job until none are left to claim.
+static void runClaimedChunks(ChunkFn fn, void* context, int chunkCount) {
+    int chunk;
+    while ((chunk = atomic_fetch_add(&pool.nextChunk, 1)) < chunkCount) {
+        fn(context, chunk);
+    }
+}
+
+/// @brief The loop of a worker thread, which helps with every job until the pool is stopped.
+static void* workerMain(void* argument) {
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool.mutex);
+    while (true) {
+        while (pool.generation == seen && !pool.stopping) {
+            pthread_cond_wait(&pool.workAvailable, &pool.mutex);
+        }
+        if (pool.stopping) {
+            break;
+        }
+
+        seen = pool.generation;
+        ChunkFn fn = pool.fn;
+        void* context = pool.context;
+        int chunkCount = pool.chunkCount;
+        ++pool.activeWorkers;
+        pthread_mutex_unlock(&pool.mutex);
+
+        runClaimedChunks(fn, context, chunkCount);
+
+        pthread_mutex_lock(&pool.mutex);
+        if (--pool.activeWorkers == 0) {
+            pthread_cond_broadcast(&pool.workDone);
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+/// @brief Starts the worker threads if they aren't running. The calling thread is one of the pool's threads.
+static void startWorkers() {
+    while (pool.workerCount < pool.threadCount - 1) {
+        if (pthread_create(&pool.workers[pool.workerCount], NULL, workerMain, NULL) != 0) {
+            // Run with the workers that did start.
+            pool.threadCount = pool.workerCount + 1;
+            return;
+        }
+        ++pool.workerCount;
+    }
+}
+
+int defaultThreadCount() {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors < 1) {
+        return 1;
+    }
+    return processors > POOL_MAX_THREADS ? POOL_MAX_THREADS : (int)processors;
+}
+
+void setThreadCount(int threadCount) {
+    freeThreadPool();
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    pool.threadCount = threadCount > POOL_MAX_THREADS ? POOL_MAX_THREADS : threadCount;
+}
+
+int threadCount() {
+    return pool.threadCount;
+}
+
+void freeThreadPool() {
+    pthread_mutex_lock(&pool.mutex);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.workAvailable);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (int i = 0; i < pool.workerCount; ++i) {
+        pthread_join(pool.workers[i], NULL);
+    }
+    pool.workerCount = 0;
+    pool.stopping = false;
+}
+
+void runChunks(ChunkFn fn, void* context, int chunkCount, bool parallel) {
+    if (!parallel || chunkCount <= 1 || pool.threadCount <= 1) {
+        for (int chunk = 0; chunk < chunkCount; ++chunk) {
+            fn(context, chunk);
+        }
+        return;
+    }
+
+    startWorkers();
+    pthread_mutex_lock(&pool.mutex);
+    // A worker that woke up too late for the last job may still be looking for its chunks, which must not be this job's.
+    while (pool.activeWorkers > 0) {
+        pthread_cond_wait(&pool.workDone, &pool.mutex);
+    }
+    pool.fn = fn;
+    pool.context = context;
+    pool.chunkCount = chunkCount;
+    atomic_store(&pool.nextChunk, 0);
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.workAvailable);
+    pthread_mutex_unlock(&pool.mutex);
+
+    // The calling thread would only wait otherwise, so it takes chunks too.
+    runClaimedChunks(fn, context, chunkCount);
+
+    // Every chunk has been claimed, but workers may still be running theirs.
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.activeWorkers > 0) {
+        pthread_cond_wait(&pool.workDone, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+#else
+// Without pthreads, every job runs on the calling thread.
+
+int defaultThreadCount() {
+    return 1;
+}
+
+void setThreadCount(int threadCount) {
+}
+
+int threadCount() {
+    return 1;
+}
+
+void freeThreadPool() {
+}
+
+void runChunks(ChunkFn fn, void* context, int chunkCount, bool parallel) {
+    for (int chunk = 0; chunk < chunkCount; ++chunk) {
+        fn(context, chunk);
+    }
+}
+#endif
@@ -132,7 +132,8 @@ static Token number() {
     while (isdigit(peek()) && !isAtEnd()) {
         advance();
     }
-    if (peek() == '.') {
+    // A second dot starts a range, as in 0..10.
+    if (peek() == '.' && peekNext() != '.') {
         advance();
         while (isdigit(peek()) && !isAtEnd()) {
             advance();
@@ -165,8 +166,6 @@ TokenType identifierType() {
             return checkKeyword(startOffset, "lass", TOKEN_CLASS);
         case 'e':
             return checkKeyword(startOffset, "lse", TOKEN_ELSE);
-        case 'i':
-            return checkKeyword(startOffset, "f", TOKEN_IF);
         case 'n':
             return checkKeyword(startOffset, "il", TOKEN_NIL);
         case 'o':
@@ -183,6 +182,17 @@ TokenType identifierType() {
             return checkKeyword(startOffset, "hile", TOKEN_WHILE);
 
         // Branching paths
+        case 'i':
+            if (scanner.current - scanner.start > 1) {
+                ++startOffset;
+                switch (scanner.start[1]) {
+                    case 'f':
+                        return checkKeyword(startOffset, "", TOKEN_IF);
+                    case 'n':
+                        return checkKeyword(startOffset, "", TOKEN_IN);
+                }
+            }
+            break;
         case 'f':
             if (scanner.current - scanner.start > 1) {
                 ++startOffset;
@@ -245,12 +255,16 @@ Token scanToken() {
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
             return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
         case ',':
             return makeToken(TOKEN_COMMA);
         case '.':
-            return makeToken(TOKEN_DOT);
+            return makeToken(match('.') ? TOKEN_DOT_DOT : TOKEN_DOT);
         case '-':
             return makeToken(TOKEN_MINUS);
         case '+':
@@ -280,4 +294,11 @@ Token scanToken() {
     }
 
     return errorToken("Unexpected character.");
-}
\ No newline at end of file
+}
+
+Token peekToken() {
+    Scanner saved = scanner;
+    Token token = scanToken();
+    scanner = saved;
+    return token;
+}
@@ -1,6 +1,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../include/allocator.h"
 #include "../include/memory.h"
 #include "../include/object.h"
 #include "../include/table.h"
@@ -10,46 +15,209 @@
 #include <stdio.h>
 #endif
 
-/// @brief A hash table's maximum load factor.
-#define TABLE_MAX_LOAD 0.75
+/// @brief A hash table's maximum load factor, counting deleted slots.
+#define TABLE_MAX_LOAD 0.875
+/// @brief Load factor below which a table is shrunk. Far enough below TABLE_MAX_LOAD that a table doesn't flip between
+/// growing and shrinking.
+#define TABLE_MIN_LOAD 0.125
+/// @brief Fraction of a table's slots that may be deleted before it is rehashed.
+#define TABLE_MAX_TOMBSTONES 0.25
+/// @brief Smallest capacity of a non-empty table.
+#define TABLE_MIN_CAPACITY 8
+/// @brief Number of slots whose control bytes are matched at once.
+#define GROUP_WIDTH 16
+
+/// @brief Control byte of a slot that has never held an entry.
+#define CONTROL_EMPTY 0x80
+/// @brief Control byte of a slot whose entry was deleted.
+#define CONTROL_DELETED 0xfe
+/// @returns Whether a control byte belongs to a full slot.
+#define IS_FULL(control) ((control) < 0x80)
+
+/// @returns The part of a hash that picks the first slot to probe.
+#define HASH_POSITION(hash) ((hash) >> 7)
+/// @returns The part of a hash that is stored in a full slot's control byte.
+#define HASH_CONTROL(hash) ((uint8_t)((hash) & 0x7f))
+
+/// @returns A bitmask with bit i set if the control byte of the group's slot i equals the given byte.
+static inline uint32_t matchControl(const uint8_t* group, uint8_t control) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i) {
+        mask |= (uint32_t)(group[i] == control) << i;
+    }
+    return mask;
+#endif
+}
+/// @returns A bitmask with bit i set if the group's slot i is empty or deleted.
+static inline uint32_t matchFree(const uint8_t* group) {
+#ifdef __SSE2__
+    // Only the markers have their high bit set.
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i) {
+        mask |= (uint32_t)(!IS_FULL(group[i])) << i;
+    }
+    return mask;
+#endif
+}
+
+/// @returns The index of the lowest set bit in a non-zero mask.
+static inline int lowestBit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int index = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        ++index;
+    }
+    return index;
+#endif
+}
+
+bool tableStatsEnabled = false;
+
+static TableStats stats[TABLE_ROLE_COUNT];
+
+/// @brief Records a lookup in the statistics of the table's role.
+static void recordLookup(Table* table, bool hit, int groupsProbed, int keyCompares) {
+    TableStats* roleStats = &stats[table->role];
+    ++roleStats->lookups;
+    roleStats->hits += hit;
+    roleStats->groupsProbed += groupsProbed;
+    roleStats->keyCompares += keyCompares;
+    if (groupsProbed > roleStats->maxGroupsProbed) {
+        roleStats->maxGroupsProbed = groupsProbed;
+    }
+}
+
+/// @brief Sets a slot's control byte along with its copies past the end of the array.
+static void setControl(uint8_t* control, int capacity, int index, uint8_t value) {
+    control[index] = value;
+    for (int copy = index + capacity; copy < capacity + GROUP_WIDTH; copy += capacity) {
+        control[copy] = value;
+    }
+}
 
-void initTable(Table* table) {
+void initTable(Table* table, TableRole role) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->role = (uint8_t)role;
+    table->inlineArrays = false;
+    table->control = NULL;
     table->entries = NULL;
 }
 
+/// @brief Points a table at the arrays in the given storage: the entries, followed by the control bytes.
+static void setInlineArrays(Table* table, void* storage) {
+    table->entries = (Entry*)storage;
+    table->control = (uint8_t*)(table->entries + table->capacity);
+}
+
+void initTableInline(Table* table, TableRole role, int capacity, void* storage) {
+    initTable(table, role);
+    table->capacity = capacity;
+    table->inlineArrays = true;
+    setInlineArrays(table, storage);
+    memset(table->control, CONTROL_EMPTY, capacity + GROUP_WIDTH);
+}
+
+void tableMoveInline(Table* table, void* storage) {
+    if (table->inlineArrays) {
+        setInlineArrays(table, storage);
+    }
+}
+
+int tableCapacityFor(int count) {
+    int capacity = TABLE_MIN_CAPACITY;
+    while (count > capacity * TABLE_MAX_LOAD) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+size_t tableInlineSize(int capacity) {
+    return sizeof(Entry) * capacity + capacity + GROUP_WIDTH;
+}
+
+/// @brief Frees a table's arrays. The control array of an empty table is never allocated, despite its copied group, and
+/// inline arrays belong to the table's owner.
+static void freeTableArrays(Table* table) {
+    if (table->capacity > 0 && !table->inlineArrays) {
+        FREE_ARRAY(uint8_t, table->control, table->capacity + GROUP_WIDTH);
+        FREE_ARRAY(Entry, table->entries, table->capacity);
+    }
+}
+
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    initTable(table);
+    freeTableArrays(table);
+    initTable(table, table->role);
 }
 
-/// @returns If found, the entry with the given key. Otherwise, an entry whose key is NULL and is suitable for insertion.
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+// Probing moves from group to group with a growing stride. Since the capacity is a power of two, this visits every slot.
 
-    while (true) {
-        Entry* entry = &entries[index];
+/// @returns The index of the slot that holds the given key, or -1 if there is none. Inlined into findSlot() once with and
+/// once without recording, so that lookups without statistics don't pay for counting.
+static inline int probeSlot(Table* table, ObjString* key, bool record) {
+    int mask = table->capacity - 1;
+    uint8_t control = HASH_CONTROL(key->hash);
+    int position = (int)(HASH_POSITION(key->hash) & mask);
 
-        if (entry->key == NULL) {
-            // Empty entry
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            }
-            // Tombstone
-            else {
-                if (tombstone == NULL) {
-                    tombstone = entry;
+    // Most lookups hit the first slot, which is worth checking before loading the group.
+    if (table->control[position] == control && table->entries[position].key == key) {
+        if (record) {
+            recordLookup(table, true, 1, 1);
+        }
+        return position;
+    }
+
+    int groupsProbed = 0;
+    int keyCompares = 0;
+    for (int stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        const uint8_t* group = &table->control[position];
+        ++groupsProbed;
+        for (uint32_t matches = matchControl(group, control); matches != 0; matches &= matches - 1) {
+            int index = (position + lowestBit(matches)) & mask;
+            ++keyCompares;
+            if (table->entries[index].key == key) {
+                if (record) {
+                    recordLookup(table, true, groupsProbed, keyCompares);
                 }
+                return index;
             }
         }
-        // Key found
-        else if (entry->key == key) {
-            return entry;
+        if (matchControl(group, CONTROL_EMPTY) != 0) {
+            if (record) {
+                recordLookup(table, false, groupsProbed, keyCompares);
+            }
+            return -1;
         }
+        position = (position + stride) & mask;
+    }
+}
+
+/// @returns The index of the slot that holds the given key, or -1 if there is none.
+static int findSlot(Table* table, ObjString* key) {
+    return tableStatsEnabled ? probeSlot(table, key, true) : probeSlot(table, key, false);
+}
 
-        index = (index + 1) & (capacity - 1);
+/// @returns The first empty or deleted slot in the given hash's probe sequence.
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash) {
+    int mask = capacity - 1;
+    int position = (int)(HASH_POSITION(hash) & mask);
+
+    for (int stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        uint32_t matches = matchFree(&control[position]);
+        if (matches != 0) {
+            return (position + lowestBit(matches)) & mask;
+        }
+        position = (position + stride) & mask;
     }
 }
 
@@ -58,57 +226,76 @@ bool tableGet(Table* table, ObjString* key, Value* out) {
         return false;
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int index = findSlot(table, key);
+    if (index < 0) {
         return false;
     }
-    *out = entry->value;
+    *out = table->entries[index].value;
     return true;
 }
 
-/// @brief Resizes the given hash table to the new capacity.
+/// @brief Rehashes the given hash table into the new capacity, which drops its deleted slots.
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; ++i) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+    if (tableStatsEnabled) {
+        TableStats* roleStats = &stats[table->role];
+        if (capacity > table->capacity) {
+            ++roleStats->grows;
+        }
+        else if (capacity < table->capacity) {
+            ++roleStats->shrinks;
+        }
+        else {
+            ++roleStats->rehashes;
+        }
     }
 
-    table->count = 0;
+    uint8_t* control = ALLOCATE(uint8_t, capacity + GROUP_WIDTH);
+    memset(control, CONTROL_EMPTY, capacity + GROUP_WIDTH);
+    Entry* entries = ALLOCATE(Entry, capacity);
+
     for (int i = 0; i < table->capacity; ++i) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) {
+        if (!IS_FULL(table->control[i])) {
             continue;
         }
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        ++table->count;
+        Entry* entry = &table->entries[i];
+        int index = findFreeSlot(control, capacity, entry->key->hash);
+        setControl(control, capacity, index, table->control[i]);
+        entries[index] = *entry;
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    freeTableArrays(table);
 
+    table->inlineArrays = false;
+    table->tombstones = 0;
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    if (table->count > 0) {
+        int index = findSlot(table, key);
+        if (index >= 0) {
+            table->entries[index].value = value;
+            return false;
+        }
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    // Increment count only if a new key was added into a truly empty slot, not just a tombstone.
-    if (isNewKey && IS_NIL(entry->value)) {
-        ++table->count;
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // Mostly deleted slots are reclaimed by rehashing in place rather than growing.
+        int capacity = table->count + 1 <= table->capacity * TABLE_MAX_LOAD / 2 ? table->capacity : GROW_CAPACITY(table->capacity);
+        adjustCapacity(table, capacity);
     }
 
-    entry->key = key;
-    entry->value = value;
-
-    return isNewKey;
+    int index = findFreeSlot(table->control, table->capacity, key->hash);
+    if (table->control[index] == CONTROL_DELETED) {
+        --table->tombstones;
+    }
+    setControl(table->control, table->capacity, index, HASH_CONTROL(key->hash));
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    ++table->count;
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
@@ -116,21 +303,44 @@ bool tableDelete(Table* table, ObjString* key) {
         return false;
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int index = findSlot(table, key);
+    if (index < 0) {
         return false;
     }
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    setControl(table->control, table->capacity, index, CONTROL_DELETED);
+    table->entries[index].key = NULL;
+    --table->count;
+    ++table->tombstones;
+    tableCompact(table);
     return true;
 }
 
+void tableCompact(Table* table) {
+    if (table->capacity == 0) {
+        return;
+    }
+    if (table->count == 0) {
+        freeTable(table);
+        return;
+    }
+
+    // Shrinking leaves the table half as full as it may get.
+    int capacity = table->capacity;
+    if (table->count < capacity * TABLE_MIN_LOAD) {
+        while (capacity > TABLE_MIN_CAPACITY && table->count <= (capacity / 2) * TABLE_MAX_LOAD / 2) {
+            capacity /= 2;
+        }
+    }
+    if (capacity != table->capacity || table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES) {
+        adjustCapacity(table, capacity);
+    }
+}
+
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; ++i) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (IS_FULL(from->control[i])) {
+            tableSet(to, from->entries[i].key, from->entries[i].value);
         }
     }
 }
@@ -140,48 +350,104 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
         return NULL;
     }
 
-    uint32_t index = hash & (table->capacity - 1);
-    while (true) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Only return NULL if a truly empty slot was found, not just a tombstone.
-            if (IS_NIL(entry->value)) {
-                return NULL;
+    int mask = table->capacity - 1;
+    uint8_t control = HASH_CONTROL(hash);
+    int position = (int)(HASH_POSITION(hash) & mask);
+
+    int groupsProbed = 0;
+    int keyCompares = 0;
+    for (int stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        const uint8_t* group = &table->control[position];
+        ++groupsProbed;
+        for (uint32_t matches = matchControl(group, control); matches != 0; matches &= matches - 1) {
+            ObjString* key = table->entries[(position + lowestBit(matches)) & mask].key;
+            ++keyCompares;
+            if (key->length == length && key->hash == hash && memcmp(stringChars(key), chars, length) == 0) {
+                if (tableStatsEnabled) {
+                    recordLookup(table, true, groupsProbed, keyCompares);
+                }
+                return key;
             }
         }
-        else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+        if (matchControl(group, CONTROL_EMPTY) != 0) {
+            if (tableStatsEnabled) {
+                recordLookup(table, false, groupsProbed, keyCompares);
+            }
+            return NULL;
         }
-        index = (index + 1) & (table->capacity - 1);
+        position = (position + stride) & mask;
     }
 }
 
 void tableRemoveWhite(Table* table) {
     for (int i = 0; i < table->capacity; ++i) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (IS_FULL(table->control[i]) && !isMarked((Obj*)table->entries[i].key)) {
+            setControl(table->control, table->capacity, i, CONTROL_DELETED);
+            table->entries[i].key = NULL;
+            --table->count;
+            ++table->tombstones;
         }
     }
 }
 void markTable(Table* table) {
     for (int i = 0; i < table->capacity; ++i) {
+        if (!IS_FULL(table->control[i])) {
+            continue;
+        }
         Entry* entry = &table->entries[i];
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
 }
 
+void relocateTable(Table* table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        if (!IS_FULL(table->control[i])) {
+            continue;
+        }
+        Entry* entry = &table->entries[i];
+        // Keys are hashed by content, so moved keys stay in the same bucket.
+        entry->key = (ObjString*)forwardingAddress((Obj*)entry->key);
+        relocateValue(&entry->value);
+    }
+}
+
+TableStats* tableStats(TableRole role) {
+    return &stats[role];
+}
+
+void sampleTableStats(Table* table) {
+    TableStats* roleStats = &stats[table->role];
+    ++roleStats->tables;
+    roleStats->capacity += table->capacity;
+    roleStats->count += table->count;
+    roleStats->tombstones += table->tombstones;
+}
+
+const char* tableRoleName(TableRole role) {
+    switch (role) {
+        case TABLE_GLOBALS:
+            return "globals";
+        case TABLE_STRINGS:
+            return "strings";
+        case TABLE_METHODS:
+            return "methods";
+        case TABLE_FIELDS:
+            return "fields";
+    }
+    return "unknown";
+}
+
 void printTable(Table* table) {
     printf("====\n");
 
     for (int i = 0; i < table->capacity; ++i) {
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) {
-            printf("NULL");
+        if (!IS_FULL(table->control[i])) {
+            printf(table->control[i] == CONTROL_DELETED ? "DELETED" : "NULL");
         }
         else {
-            printf("%s ", entry->key->chars);
+            printf("%.*s ", entry->key->length, stringChars(entry->key));
             printValue(entry->value);
         }
         printf("\n");
@@ -7,10 +7,17 @@
 
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
+    if (IS_INT(a) && IS_INT(b)) {
+        return a == b;
+    }
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b) {
+        return true;
+    }
+    // Only interned strings are unique, so other strings are compared by content.
+    return IS_STRING_OR_ROPE(a) && IS_STRING_OR_ROPE(b) && stringsEqual(AS_OBJ(a), AS_OBJ(b));
 #else
     if (a.type != b.type) {
         return false;
@@ -23,7 +30,10 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ: {
-            return AS_OBJ(a) == AS_OBJ(b);
+            if (AS_OBJ(a) == AS_OBJ(b)) {
+                return true;
+            }
+            return IS_STRING_OR_ROPE(a) && IS_STRING_OR_ROPE(b) && stringsEqual(AS_OBJ(a), AS_OBJ(b));
         }
         default:
             // Unreachable
@@ -32,6 +42,41 @@ bool valuesEqual(Value a, Value b) {
 #endif
 }
 
+#ifndef NAN_BOXING
+/// @returns The bits of a value's payload. Values of different types may share them.
+static uint64_t payloadBits(Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            return AS_BOOL(value);
+        case VAL_NUMBER: {
+            uint64_t bits;
+            double number = AS_NUMBER(value);
+            memcpy(&bits, &number, sizeof(bits));
+            return bits;
+        }
+        case VAL_OBJ:
+            return (uintptr_t)AS_OBJ(value);
+        default:
+            return 0;
+    }
+}
+#endif
+
+bool valuesIdentical(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    return a.type == b.type && payloadBits(a) == payloadBits(b);
+#endif
+}
+uint32_t hashValueIdentity(Value value) {
+#ifdef NAN_BOXING
+    return hashBits(value);
+#else
+    return hashBits(payloadBits(value) ^ value.type);
+#endif
+}
+
 void initValueArray(ValueArray* array) {
     array->count = 0;
     array->capacity = 0;
@@ -1,13 +1,17 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+#include "../include/bulk.h"
 #include "../include/common.h"
 #include "../include/compiler.h"
 #include "../include/debug.h"
+#include "../include/kernels.h"
 #include "../include/memory.h"
 #include "../include/object.h"
+#include "../include/pool.h"
 #include "../include/value.h"
 #include "../include/vm.h"
 
@@ -17,8 +21,86 @@
 VM vm;
 
 /// @brief Native function to output seconds since the start of the program.
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(int argCount, Value* args, Value* result) {
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+/// @brief Sets a number field on an instance that is on top of the stack.
+static void setStatField(const char* name, double value) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    tableSet(&AS_INSTANCE(vm.stackTop[-2])->fields, AS_STRING(vm.stackTop[-1]), NUMBER_VAL(value));
+    pop();
+}
+/// @brief Pushes an instance of a new class with the given name.
+static void pushStatInstance(const char* name) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    push(OBJ_VAL(newClass(AS_STRING(vm.stackTop[-1]))));
+    ObjInstance* instance = newInstance(AS_CLASS(vm.stackTop[-1]));
+    pop();
+    pop();
+    push(OBJ_VAL(instance));
+}
+/// @brief Sets the instance on top of the stack as a field of the instance below it, and pops it.
+static void setStatInstanceField(const char* name) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    tableSet(&AS_INSTANCE(vm.stackTop[-3])->fields, AS_STRING(vm.stackTop[-1]), vm.stackTop[-2]);
+    pop();
+    pop();
+}
+
+/// @brief Native function that returns an instance holding the garbage collector's statistics.
+static bool gcStatsNative(int argCount, Value* args, Value* result) {
+    GCStats stats;
+    getGCStats(&stats);
+
+    pushStatInstance("GCStats");
+    setStatField("collections", (double)stats.collections);
+    setStatField("compactions", (double)stats.compactions);
+    setStatField("bytesAllocated", (double)stats.bytesAllocated);
+    setStatField("bytesFreed", (double)stats.bytesFreed);
+    setStatField("heapBytes", (double)vm.bytesAllocated);
+    setStatField("liveBytesAfterGC", (double)stats.liveBytesAfterGC);
+    setStatField("pauseTotalMs", stats.pauseTotalNanos / 1e6);
+    setStatField("pauseMaxMs", stats.pauseMaxNanos / 1e6);
+
+    // Live objects by type, keyed by type name in camel case.
+    pushStatInstance("GCObjectCounts");
+    const char* names[OBJ_TYPE_COUNT] = {
+        [OBJ_BOUND_METHOD] = "boundMethod",
+        [OBJ_CLASS] = "class",
+        [OBJ_CLOSURE] = "closure",
+        [OBJ_FLOAT64_ARRAY] = "float64Array",
+        [OBJ_FUNCTION] = "function",
+        [OBJ_INSTANCE] = "instance",
+        [OBJ_LIST] = "list",
+        [OBJ_MAP] = "map",
+        [OBJ_NATIVE] = "native",
+        [OBJ_ROPE] = "rope",
+        [OBJ_STRING] = "string",
+        [OBJ_UPVALUE] = "upvalue",
+    };
+    for (int type = 0; type < OBJ_TYPE_COUNT; ++type) {
+        setStatField(names[type], (double)(stats.objectsAllocated[type] - stats.objectsFreed[type]));
+    }
+    setStatInstanceField("objects");
+
+    // Pause counts by upper bound, e.g. under64us.
+    pushStatInstance("GCPauseHistogram");
+    for (int bucket = 0; bucket < GC_PAUSE_BUCKETS; ++bucket) {
+        char name[32];
+        if (bucket == GC_PAUSE_BUCKETS - 1) {
+            snprintf(name, sizeof(name), "over%lluus", 1ull << (bucket - 1));
+        }
+        else {
+            snprintf(name, sizeof(name), "under%lluus", 1ull << bucket);
+        }
+        setStatField(name, (double)stats.pauseHistogram[bucket]);
+    }
+    setStatInstanceField("pauseHistogram");
+
+    *result = pop();
+    return true;
 }
 
 /// @brief "Clear"s the VM's value stack by resetting the stackTop pointer.
@@ -45,7 +127,7 @@ static void runtimeError(const char* format, ...) {
             fprintf(stderr, "script");
         }
         else {
-            fprintf(stderr, "%s()", function->name->chars);
+            fprintf(stderr, "%.*s()", function->name->length, stringChars(function->name));
         }
         fprintf(stderr, "\n");
     }
@@ -62,30 +144,354 @@ static void defineNative(const char* name, NativeFn function) {
     pop();
 }
 
+/// @brief Converts a list or array index to an int, which must be below the given limit.
+/// @returns Whether the index is an integer in range. Reports a runtime error if it isn't.
+static bool checkIndex(Value value, int limit, int* index) {
+    if (IS_INT(value)) {
+        *index = AS_INT(value);
+    }
+    else {
+        double number = IS_NUMBER(value) ? AS_NUMBER(value) : 0.5;
+        if (!(number >= INT32_MIN && number <= INT32_MAX) || (double)(int32_t)number != number) {
+            runtimeError("Index must be an integer.");
+            return false;
+        }
+        *index = (int32_t)number;
+    }
+
+    if (*index < 0 || *index >= limit) {
+        runtimeError("Index out of range.");
+        return false;
+    }
+    return true;
+}
+
+static bool listInsert(Obj* receiver, Value* args, Value* result) {
+    ObjList* list = (ObjList*)receiver;
+    int index;
+    if (!checkIndex(args[0], list->count + 1, &index)) {
+        return false;
+    }
+    // Appending first grows the storage; the moved-up elements then overwrite it.
+    listAppend(list, args[1]);
+    memmove(list->items + index + 1, list->items + index, sizeof(Value) * (list->count - 1 - index));
+    list->items[index] = args[1];
+    *result = NIL_VAL;
+    return true;
+}
+static bool listLen(Obj* receiver, Value* args, Value* result) {
+    *result = INT_VAL(((ObjList*)receiver)->count);
+    return true;
+}
+static bool listPop(Obj* receiver, Value* args, Value* result) {
+    ObjList* list = (ObjList*)receiver;
+    if (list->count == 0) {
+        runtimeError("Can't pop from an empty list.");
+        return false;
+    }
+    *result = list->items[--list->count];
+    return true;
+}
+static bool listPush(Obj* receiver, Value* args, Value* result) {
+    listAppend((ObjList*)receiver, args[0]);
+    *result = NIL_VAL;
+    return true;
+}
+
+/// @brief Checks that a value can be used as a map key.
+/// @returns Whether it can. Reports a runtime error if it can't.
+static bool checkMapKey(Value key) {
+    // NaN isn't equal to itself, so it could never be found again.
+    if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) {
+        runtimeError("Map key can't be NaN.");
+        return false;
+    }
+    return true;
+}
+
+/// @brief Adds the count key-value pairs starting at pairs, which must be reachable by the GC, to a map.
+/// @returns Whether all of the keys are valid. Reports a runtime error if one isn't.
+static bool addPairs(ObjMap* map, Value* pairs, int count) {
+    mapReserve(&map->map, count);
+    for (int i = 0; i < count; ++i) {
+        if (!checkMapKey(pairs[2 * i])) {
+            return false;
+        }
+        mapSet(&map->map, pairs[2 * i], pairs[2 * i + 1]);
+    }
+    return true;
+}
+
+/// @brief Collects a map's keys or values into a new list, in insertion order.
+static ObjList* mapToList(Map* map, bool keys) {
+    ObjList* list = newList(NULL, 0);
+    push(OBJ_VAL(list));
+    for (int i = 0; i < map->entryCount; ++i) {
+        MapEntry* entry = &map->entries[i];
+        if (!entry->removed) {
+            listAppend(list, keys ? entry->key : entry->value);
+        }
+    }
+    pop();
+    return list;
+}
+
+static bool mapHas(Obj* receiver, Value* args, Value* result) {
+    Value value;
+    *result = BOOL_VAL(mapGet(&((ObjMap*)receiver)->map, args[0], &value));
+    return true;
+}
+static bool mapKeys(Obj* receiver, Value* args, Value* result) {
+    *result = OBJ_VAL(mapToList(&((ObjMap*)receiver)->map, true));
+    return true;
+}
+static bool mapLen(Obj* receiver, Value* args, Value* result) {
+    *result = INT_VAL(((ObjMap*)receiver)->map.count);
+    return true;
+}
+static bool mapRemoveMethod(Obj* receiver, Value* args, Value* result) {
+    *result = BOOL_VAL(mapRemove(&((ObjMap*)receiver)->map, args[0]));
+    return true;
+}
+static bool mapValues(Obj* receiver, Value* args, Value* result) {
+    *result = OBJ_VAL(mapToList(&((ObjMap*)receiver)->map, false));
+    return true;
+}
+
+/// @brief Native function that creates a Float64Array, either of the given length with all elements zero, or holding the
+/// numbers in the given list.
+static bool float64ArrayNative(int argCount, Value* args, Value* result) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 arguments but got %d.", argCount);
+        return false;
+    }
+
+    if (IS_LIST(args[0])) {
+        ObjList* list = AS_LIST(args[0]);
+        for (int i = 0; i < list->count; ++i) {
+            if (!IS_NUMBER(list->items[i])) {
+                runtimeError("Float64Array elements must be numbers.");
+                return false;
+            }
+        }
+        ObjFloat64Array* array = newFloat64Array(list->count);
+        for (int i = 0; i < list->count; ++i) {
+            array->data[i] = AS_NUMBER(list->items[i]);
+        }
+        *result = OBJ_VAL(array);
+        return true;
+    }
+
+    if (!IS_NUMBER(args[0])) {
+        runtimeError("Float64Array takes a length or a list of numbers.");
+        return false;
+    }
+    double length = AS_NUMBER(args[0]);
+    if (!(length >= 0 && length <= INT32_MAX) || (double)(int32_t)length != length) {
+        runtimeError("Float64Array length must be a non-negative integer.");
+        return false;
+    }
+    *result = OBJ_VAL(newFloat64Array((int)length));
+    return true;
+}
+
+/// @brief Checks that a method argument is a Float64Array of the given length.
+/// @returns The array, or NULL after reporting a runtime error.
+static ObjFloat64Array* float64ArrayArgument(Value value, int length) {
+    if (!IS_FLOAT64_ARRAY(value)) {
+        runtimeError("Expected a Float64Array.");
+        return NULL;
+    }
+    if (AS_FLOAT64_ARRAY(value)->length != length) {
+        runtimeError("Float64Arrays must have the same length.");
+        return NULL;
+    }
+    return AS_FLOAT64_ARRAY(value);
+}
+/// @brief Checks that a method argument is a number.
+/// @returns Whether it is. Reports a runtime error if it isn't.
+static bool numberArgument(Value value) {
+    if (!IS_NUMBER(value)) {
+        runtimeError("Expected a number.");
+        return false;
+    }
+    return true;
+}
+
+static bool float64ArrayAxpy(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* y = (ObjFloat64Array*)receiver;
+    ObjFloat64Array* x;
+    if (!numberArgument(args[0]) || (x = float64ArrayArgument(args[1], y->length)) == NULL) {
+        return false;
+    }
+    bulkAxpy(y->data, x->data, (size_t)y->length, AS_NUMBER(args[0]));
+    *result = OBJ_VAL(receiver);
+    return true;
+}
+static bool float64ArrayDot(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* x = (ObjFloat64Array*)receiver;
+    ObjFloat64Array* y = float64ArrayArgument(args[0], x->length);
+    if (y == NULL) {
+        return false;
+    }
+    *result = NUMBER_VAL(bulkDot(x->data, y->data, (size_t)x->length));
+    return true;
+}
+static bool float64ArrayLen(Obj* receiver, Value* args, Value* result) {
+    *result = INT_VAL(((ObjFloat64Array*)receiver)->length);
+    return true;
+}
+static bool float64ArrayMax(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* x = (ObjFloat64Array*)receiver;
+    if (x->length == 0) {
+        runtimeError("Can't take the maximum of an empty array.");
+        return false;
+    }
+    *result = NUMBER_VAL(bulkMax(x->data, (size_t)x->length));
+    return true;
+}
+static bool float64ArrayMin(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* x = (ObjFloat64Array*)receiver;
+    if (x->length == 0) {
+        runtimeError("Can't take the minimum of an empty array.");
+        return false;
+    }
+    *result = NUMBER_VAL(bulkMin(x->data, (size_t)x->length));
+    return true;
+}
+static bool float64ArrayPrefixSum(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* x = (ObjFloat64Array*)receiver;
+    bulkPrefixSum(x->data, (size_t)x->length);
+    *result = OBJ_VAL(receiver);
+    return true;
+}
+static bool float64ArrayScale(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* x = (ObjFloat64Array*)receiver;
+    if (!numberArgument(args[0])) {
+        return false;
+    }
+    bulkScale(x->data, (size_t)x->length, AS_NUMBER(args[0]));
+    *result = OBJ_VAL(receiver);
+    return true;
+}
+static bool float64ArraySort(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* x = (ObjFloat64Array*)receiver;
+    bulkSort(x->data, (size_t)x->length);
+    *result = OBJ_VAL(receiver);
+    return true;
+}
+static bool float64ArraySum(Obj* receiver, Value* args, Value* result) {
+    ObjFloat64Array* x = (ObjFloat64Array*)receiver;
+    *result = NUMBER_VAL(bulkSum(x->data, (size_t)x->length));
+    return true;
+}
+
+/// @brief Defines a Float64Array method that applies an operation elementwise with another array of the same length, in
+/// place.
+#define FLOAT64_ARRAY_ELEMENTWISE(name, op)                                 \
+    static bool name(Obj* receiver, Value* args, Value* result) {               \
+        ObjFloat64Array* y = (ObjFloat64Array*)receiver;                        \
+        ObjFloat64Array* x = float64ArrayArgument(args[0], y->length);          \
+        if (x == NULL) {                                                        \
+            return false;                                                       \
+        }                                                                       \
+        bulkElementwise(op, y->data, x->data, (size_t)y->length);               \
+        *result = OBJ_VAL(receiver);                                            \
+        return true;                                                            \
+    }
+
+FLOAT64_ARRAY_ELEMENTWISE(float64ArrayAdd, BULK_ADD)
+FLOAT64_ARRAY_ELEMENTWISE(float64ArrayDiv, BULK_DIV)
+FLOAT64_ARRAY_ELEMENTWISE(float64ArrayMul, BULK_MUL)
+FLOAT64_ARRAY_ELEMENTWISE(float64ArraySub, BULK_SUB)
+
+#undef FLOAT64_ARRAY_ELEMENTWISE
+
+/// @brief Gives a built-in type a method, which is dispatched by selector like the methods of classes.
+static void defineBuiltinMethod(BuiltinMethods* methods, const char* name, int arity, BuiltinMethodFn function) {
+    int selector = selectorFor(copyString(name, (int)strlen(name)));
+    if (selector >= methods->count) {
+        int oldCount = methods->count;
+        int count = selector + 1;
+        methods->methods = GROW_ARRAY(BuiltinMethod, methods->methods, oldCount, count);
+        memset(methods->methods + oldCount, 0, sizeof(BuiltinMethod) * (count - oldCount));
+        methods->count = count;
+    }
+    methods->methods[selector].function = function;
+    methods->methods[selector].arity = arity;
+}
+
 void initVM() {
     resetStack();
-    vm.objects = NULL;
+    initHeap(&vm.heap);
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.allocationFailure = NULL;
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+    GCPolicy policy;
+    initGCPolicy(&policy);
+    setGCPolicy(&policy);
+    vm.compactionPending = false;
+    vm.collecting = false;
 
     vm.grayCapacity = 0;
     vm.grayCount = 0;
     vm.grayStack = NULL;
 
-    initTable(&vm.strings);
-    initTable(&vm.globals);
+    initTable(&vm.strings, TABLE_STRINGS);
+    initTable(&vm.globals, TABLE_GLOBALS);
+
+    initTable(&vm.selectors, TABLE_METHODS);
+    initValueArray(&vm.selectorNames);
+    vm.initSelector = selectorFor(copyString("init", 4));
 
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    vm.listMethods.methods = NULL;
+    vm.listMethods.count = 0;
+    defineBuiltinMethod(&vm.listMethods, "insert", 2, listInsert);
+    defineBuiltinMethod(&vm.listMethods, "len", 0, listLen);
+    defineBuiltinMethod(&vm.listMethods, "pop", 0, listPop);
+    defineBuiltinMethod(&vm.listMethods, "push", 1, listPush);
+
+    vm.mapMethods.methods = NULL;
+    vm.mapMethods.count = 0;
+    defineBuiltinMethod(&vm.mapMethods, "has", 1, mapHas);
+    defineBuiltinMethod(&vm.mapMethods, "keys", 0, mapKeys);
+    defineBuiltinMethod(&vm.mapMethods, "len", 0, mapLen);
+    defineBuiltinMethod(&vm.mapMethods, "remove", 1, mapRemoveMethod);
+    defineBuiltinMethod(&vm.mapMethods, "values", 0, mapValues);
+
+    vm.float64ArrayMethods.methods = NULL;
+    vm.float64ArrayMethods.count = 0;
+    defineBuiltinMethod(&vm.float64ArrayMethods, "add", 1, float64ArrayAdd);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "axpy", 2, float64ArrayAxpy);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "div", 1, float64ArrayDiv);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "dot", 1, float64ArrayDot);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "len", 0, float64ArrayLen);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "max", 0, float64ArrayMax);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "min", 0, float64ArrayMin);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "mul", 1, float64ArrayMul);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "prefixSum", 0, float64ArrayPrefixSum);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "scale", 1, float64ArrayScale);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "sort", 0, float64ArraySort);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "sub", 1, float64ArraySub);
+    defineBuiltinMethod(&vm.float64ArrayMethods, "sum", 0, float64ArraySum);
+    selectKernels(detectKernelLevel());
+    setThreadCount(defaultThreadCount());
 
     defineNative("clock", clockNative);
+    defineNative("gcStats", gcStatsNative);
+    defineNative("Float64Array", float64ArrayNative);
 }
 
 void freeVM() {
     freeTable(&vm.strings);
     freeTable(&vm.globals);
-    vm.initString = NULL;
+    freeTable(&vm.selectors);
+    freeValueArray(&vm.selectorNames);
+    FREE_ARRAY(BuiltinMethod, vm.listMethods.methods, vm.listMethods.count);
+    FREE_ARRAY(BuiltinMethod, vm.mapMethods.methods, vm.mapMethods.count);
+    FREE_ARRAY(BuiltinMethod, vm.float64ArrayMethods.methods, vm.float64ArrayMethods.count);
     freeObjects();
+    freeThreadPool();
 }
 
 /// @returns The value at the distance from the top of the stack, 0 for the value at the top.
@@ -100,7 +506,8 @@ static bool call(ObjClosure* closure, int argCount) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == FRAMES_MAX ||
+        vm.stackTop - argCount - 1 + closure->function->stackSize > vm.stack + STACK_MAX - STACK_HEADROOM) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -124,9 +531,8 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLASS: {
                 ObjClass* loxClass = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(loxClass));
-                Value initializer;
-                if (tableGet(&loxClass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (loxClass->initializer != NULL) {
+                    return call(loxClass->initializer, argCount);
                 }
                 else if (argCount != 0) {
                     runtimeError("Expected 0 arguments but got %d.", argCount);
@@ -138,7 +544,10 @@ static bool callValue(Value callee, int argCount) {
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
+                Value result;
+                if (!native(argCount, vm.stackTop - argCount, &result)) {
+                    return false;
+                }
                 vm.stackTop -= argCount + 1;
                 push(result);
                 return true;
@@ -151,43 +560,107 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-/// @brief Invokes a method invocation on the given class.
-static bool invokeFromClass(ObjClass* loxClass, ObjString* name, int argCount) {
+int selectorFor(ObjString* name) {
+    Value selector;
+    if (tableGet(&vm.selectors, name, &selector)) {
+        return AS_INT(selector);
+    }
+
+    push(OBJ_VAL(name));
+    int index = vm.selectorNames.count;
+    writeValueArray(&vm.selectorNames, OBJ_VAL(name));
+    tableSet(&vm.selectors, name, INT_VAL(index));
+    pop();
+    return index;
+}
+
+/// @returns The name of the method with the given selector.
+static ObjString* selectorName(int selector) {
+    return AS_STRING(vm.selectorNames.values[selector]);
+}
+
+/// @returns The class's method with the given selector, or NULL if it has none.
+static ObjClosure* findMethod(ObjClass* loxClass, int selector) {
+    if (selector < loxClass->methodCount) {
+        return loxClass->methods[selector];
+    }
     Value method;
-    if (!tableGet(&loxClass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+    if (loxClass->sparseMethods.count > 0 && tableGet(&loxClass->sparseMethods, selectorName(selector), &method)) {
+        return AS_CLOSURE(method);
+    }
+    return NULL;
+}
+
+/// @brief Invokes a method invocation on the given class.
+static bool invokeFromClass(ObjClass* loxClass, int selector, int argCount) {
+    ObjClosure* method = findMethod(loxClass, selector);
+    if (method == NULL) {
+        ObjString* name = selectorName(selector);
+        runtimeError("Undefined property '%.*s'.", name->length, stringChars(name));
+        return false;
+    }
+
+    return call(method, argCount);
+}
+
+/// @brief Calls a method of a built-in type, leaving its result in place of the receiver and its arguments.
+static bool invokeBuiltin(BuiltinMethods* methods, Obj* receiver, int selector, int argCount) {
+    BuiltinMethod* method = selector < methods->count ? &methods->methods[selector] : NULL;
+    if (method == NULL || method->function == NULL) {
+        ObjString* name = selectorName(selector);
+        runtimeError("Undefined property '%.*s'.", name->length, stringChars(name));
+        return false;
+    }
+    if (argCount != method->arity) {
+        runtimeError("Expected %d arguments but got %d.", method->arity, argCount);
         return false;
     }
 
-    return call(AS_CLOSURE(method), argCount);
+    Value result;
+    if (!method->function(receiver, vm.stackTop - argCount, &result)) {
+        return false;
+    }
+    vm.stackTop -= argCount;
+    vm.stackTop[-1] = result;
+    return true;
 }
 
 /// @brief Invokes a method immediately.
 /// @return Whether the invocation succeeded.
-static bool invoke(ObjString* name, int argCount) {
+static bool invoke(int selector, int argCount) {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
+        if (IS_LIST(receiver)) {
+            return invokeBuiltin(&vm.listMethods, AS_OBJ(receiver), selector, argCount);
+        }
+        if (IS_MAP(receiver)) {
+            return invokeBuiltin(&vm.mapMethods, AS_OBJ(receiver), selector, argCount);
+        }
+        if (IS_FLOAT64_ARRAY(receiver)) {
+            return invokeBuiltin(&vm.float64ArrayMethods, AS_OBJ(receiver), selector, argCount);
+        }
         runtimeError("Only instances have methods.");
         return false;
     }
     ObjInstance* instance = AS_INSTANCE(receiver);
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (tableGet(&instance->fields, selectorName(selector), &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
-    return invokeFromClass(instance->loxClass, name, argCount);
+    return invokeFromClass(instance->loxClass, selector, argCount);
 }
 
 /// @brief Binds the method at the top of the stack to the instance just below it.
-static bool bindMethod(ObjClass* loxClass, ObjString* name) {
-    Value method;
-    if (!tableGet(&loxClass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+static bool bindMethod(ObjClass* loxClass, int selector) {
+    ObjClosure* method = findMethod(loxClass, selector);
+    if (method == NULL) {
+        ObjString* name = selectorName(selector);
+        runtimeError("Undefined property '%.*s'.", name->length, stringChars(name));
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
 
@@ -230,11 +703,61 @@ static void closeUpvalues(Value* last) {
     }
 }
 
+/// @returns Whether a class's method array may grow to the given length, which it may while most of it would be used.
+static bool methodsDenseEnough(ObjClass* loxClass, int count) {
+    if (count <= METHODS_DENSE_MIN) {
+        return true;
+    }
+    // Counts the method about to be defined too.
+    int methods = loxClass->sparseMethods.count + 1;
+    for (int i = 0; i < loxClass->methodCount; ++i) {
+        if (loxClass->methods[i] != NULL) {
+            ++methods;
+        }
+    }
+    return count <= methods * METHODS_SLOTS_PER_METHOD;
+}
+
+/// @brief Grows a class's method array to the given length, moving the sparse methods it now covers into it.
+static void growMethods(ObjClass* loxClass, int count) {
+    int oldCount = loxClass->methodCount;
+    loxClass->methods = GROW_ARRAY(ObjClosure*, loxClass->methods, oldCount, count);
+    memset(loxClass->methods + oldCount, 0, sizeof(ObjClosure*) * (count - oldCount));
+    loxClass->methodCount = count;
+
+    Table* sparse = &loxClass->sparseMethods;
+    for (int selector = oldCount; selector < count && sparse->count > 0; ++selector) {
+        Value method;
+        if (tableGet(sparse, selectorName(selector), &method)) {
+            loxClass->methods[selector] = AS_CLOSURE(method);
+            tableDelete(sparse, selectorName(selector));
+        }
+    }
+}
+
 /// @brief Defines a method.
-static void defineMethod(ObjString* name) {
-    Value method = peek(0);
+static void defineMethod(int selector) {
     ObjClass* loxClass = AS_CLASS(peek(1));
-    tableSet(&loxClass->methods, name, method);
+    if (selector >= loxClass->methodCount) {
+        int count = GROW_CAPACITY(loxClass->methodCount);
+        while (count <= selector) {
+            count *= 2;
+        }
+        if (methodsDenseEnough(loxClass, count)) {
+            growMethods(loxClass, count);
+        }
+    }
+
+    ObjClosure* method = AS_CLOSURE(peek(0));
+    if (selector < loxClass->methodCount) {
+        loxClass->methods[selector] = method;
+    }
+    else {
+        tableSet(&loxClass->sparseMethods, selectorName(selector), OBJ_VAL(method));
+    }
+    if (selector == vm.initSelector) {
+        loxClass->initializer = method;
+    }
     pop();
 }
 
@@ -249,20 +772,40 @@ static bool isFalsey(Value value) {
 }
 
 /// @brief Concatenates the first-from-stack-top string onto the end of the second-from-stack-top string and pushes it back onto the stack.
-static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+/// @returns Whether the result's length fits in an int. Reports a runtime error if it doesn't.
+static bool concatenate() {
+    Obj* b = AS_OBJ(peek(0));
+    Obj* a = AS_OBJ(peek(1));
+    int aLength = stringLength(a);
+    int bLength = stringLength(b);
+    // Ropes make doubling a string cheap, so the length can overflow long before memory runs out.
+    if (aLength > INT_MAX - bLength) {
+        runtimeError("String too long.");
+        return false;
+    }
 
-    ObjString* result = takeString(chars, length);
+    Obj* result;
+    if (aLength == 0) {
+        result = b;
+    }
+    else if (bLength == 0) {
+        result = a;
+    }
+    else if (aLength + bLength < ROPE_MIN_LENGTH) {
+        // Both sides are flat, since every rope is at least ROPE_MIN_LENGTH long. The result is only interned if it is
+        // ever used as a key.
+        ObjString* string = newString(aLength + bLength);
+        memcpy(string->chars, stringChars((ObjString*)a), aLength);
+        memcpy(string->chars + aLength, stringChars((ObjString*)b), bLength);
+        result = (Obj*)string;
+    }
+    else {
+        result = (Obj*)newRope(a, b);
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
+    return true;
 }
 
 /// @brief Performs a binary operation on the top two values in the stack and pushes the result back onto the stack.
@@ -277,6 +820,261 @@ static void concatenate() {
         push(valueType(a op b));                          \
     } while (false)
 
+/// @brief Performs a comparison, without converting the operands to doubles if both are small integers.
+#define COMPARISON_OP(op)                                     \
+    do {                                                      \
+        if (CHECK_TOP_TWO(IS_INT)) {                          \
+            bool result = AS_INT(peek(1)) op AS_INT(peek(0)); \
+            pop();                                            \
+            setTopValue(BOOL_VAL(result));                    \
+        }                                                     \
+        else {                                                \
+            BINARY_OP(BOOL_VAL, op);                          \
+        }                                                     \
+    } while (false)
+
+/// @brief Moves the instruction pointer by the offset of a branch that is taken. Backward branches are safepoints, like
+/// OP_LOOP.
+#define TAKE_BRANCH(offset, backward)    \
+    do {                                 \
+        if (backward) {                  \
+            frame->ip -= offset;         \
+            SAFEPOINT();                 \
+        }                                \
+        else {                           \
+            frame->ip += offset;         \
+        }                                \
+    } while (false)
+
+/// @brief Compares the top two values like COMPARISON_OP, pops them and takes the branch if the result is when.
+#define BRANCH_IF_COMPARISON(op, when, backward)                    \
+    do {                                                            \
+        uint16_t offset = READ_SHORT();                             \
+        bool result;                                                \
+        if (CHECK_TOP_TWO(IS_INT)) {                                \
+            result = AS_INT(peek(1)) op AS_INT(peek(0));            \
+        }                                                           \
+        else if (CHECK_TOP_TWO(IS_NUMBER)) {                        \
+            result = AS_NUMBER(peek(1)) op AS_NUMBER(peek(0));      \
+        }                                                           \
+        else {                                                      \
+            runtimeError("Operands must be numbers.");              \
+            return INTERPRET_RUNTIME_ERROR;                         \
+        }                                                           \
+        pop();                                                      \
+        pop();                                                      \
+        if (result == when) {                                       \
+            TAKE_BRANCH(offset, backward);                          \
+        }                                                           \
+    } while (false)
+
+/// @brief Compares the top two values for equality like OP_EQUAL, pops them and takes the branch if the result is when.
+/// Comparing ropes flattens them, so the operands stay on the stack until then.
+#define BRANCH_IF_EQUAL(when, backward)                             \
+    do {                                                            \
+        uint16_t offset = READ_SHORT();                             \
+        bool result = valuesEqual(peek(1), peek(0));                \
+        pop();                                                      \
+        pop();                                                      \
+        if (result == when) {                                       \
+            TAKE_BRANCH(offset, backward);                          \
+        }                                                           \
+    } while (false)
+
+/// @brief Pops the value on top of the stack and takes the branch if whether it is nil is when.
+#define BRANCH_IF_NIL(when, backward)                               \
+    do {                                                            \
+        uint16_t offset = READ_SHORT();                             \
+        if (IS_NIL(pop()) == when) {                                \
+            TAKE_BRANCH(offset, backward);                          \
+        }                                                           \
+    } while (false)
+
+/// @brief Applies an arithmetic instruction to the top two values if both are small integers and so is the result.
+/// @returns Whether the result replaced the operands. Otherwise the instruction falls back to doubles.
+static inline bool intArithmetic(uint8_t instruction) {
+    if (!CHECK_TOP_TWO(IS_INT)) {
+        return false;
+    }
+    int64_t a = AS_INT(peek(1));
+    int64_t b = AS_INT(peek(0));
+    int64_t result;
+    switch (instruction) {
+        case OP_ADD:
+            result = a + b;
+            break;
+        case OP_SUBTRACT:
+            result = a - b;
+            break;
+        case OP_MULTIPLY:
+            result = a * b;
+            // A zero product with a negative factor is -0, which only a double holds.
+            if (result == 0 && (a < 0 || b < 0)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+    }
+    if (result < INT32_MIN || result > INT32_MAX) {
+        return false;
+    }
+    pop();
+    setTopValue(INT_VAL((int32_t)result));
+    return true;
+}
+
+/// @brief Largest magnitude of a bound of a non-empty range. Past 2^53, adding one to a double counter can leave it unchanged,
+/// so the loop would never end.
+#define RANGE_BOUND_MAX 9007199254740992.0
+
+/// @brief Checks the bounds of a range loop, held in the counter slot and the one after it, and normalizes them so that
+/// OP_FOR_RANGE can step without checking them again: both are small integers if the counter is one and the end fits, and
+/// both are doubles otherwise.
+/// @returns Whether both bounds are numbers, within RANGE_BOUND_MAX of zero unless the range is empty. Reports a runtime
+/// error if they aren't.
+static bool enterRange(Value* bounds) {
+    if (!IS_NUMBER(bounds[0]) || !IS_NUMBER(bounds[1])) {
+        runtimeError("Range bounds must be numbers.");
+        return false;
+    }
+    if (IS_INT(bounds[0]) && !IS_INT(bounds[1])) {
+        double end = AS_NUMBER(bounds[1]);
+        if (end != end || end < INT32_MIN) {
+            // No integer is below the end, so the range is empty.
+            bounds[1] = bounds[0];
+            return true;
+        }
+        if (end <= INT32_MAX) {
+            // An integer counter is below the end exactly when it is below the end rounded up.
+            int32_t whole = (int32_t)end;
+            if (whole < end) {
+                ++whole;
+            }
+            bounds[1] = INT_VAL(whole);
+            return true;
+        }
+    }
+    if (!IS_INT(bounds[0]) || !IS_INT(bounds[1])) {
+        double start = AS_NUMBER(bounds[0]);
+        double end = AS_NUMBER(bounds[1]);
+        if (start < end && (start < -RANGE_BOUND_MAX || end > RANGE_BOUND_MAX)) {
+            runtimeError("Range bounds must be between -2^53 and 2^53.");
+            return false;
+        }
+        bounds[0] = NUMBER_VAL(start);
+        bounds[1] = NUMBER_VAL(end);
+    }
+    return true;
+}
+
+/// @brief Pushes the value of a global variable.
+/// @returns Whether it is defined. Reports a runtime error if it isn't.
+static inline bool getGlobal(ObjString* name) {
+    Value value;
+    if (!tableGet(&vm.globals, name, &value)) {
+        runtimeError("Undefined global variable '%.*s'.", name->length, stringChars(name));
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+/// @brief Assigns the value on top of the stack to a global variable, leaving it there.
+/// @returns Whether it is defined. Reports a runtime error if it isn't.
+static inline bool setGlobal(ObjString* name) {
+    if (tableSet(&vm.globals, name, peek(0))) {
+        tableDelete(&vm.globals, name);
+        runtimeError("Undefined global variable '%.*s'.", name->length, stringChars(name));
+        return false;
+    }
+    return true;
+}
+
+/// @brief Replaces the instance on top of the stack with the value of one of its fields, or one of its methods bound to it.
+/// @returns Whether the property exists. Reports a runtime error if it doesn't.
+static inline bool getProperty(ObjString* name) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+    Value value;
+    if (tableGet(&instance->fields, name, &value)) {
+        setTopValue(value);
+        return true;
+    }
+
+    // Only names that some class uses as a method have a selector.
+    Value selector;
+    if (!tableGet(&vm.selectors, name, &selector)) {
+        runtimeError("Undefined property '%.*s'.", name->length, stringChars(name));
+        return false;
+    }
+    return bindMethod(instance->loxClass, AS_INT(selector));
+}
+
+/// @brief Assigns the value on top of the stack to a field of the instance below it, and replaces both with the value.
+/// @returns Whether the target is an instance. Reports a runtime error if it isn't.
+static inline bool setProperty(ObjString* name) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(1));
+    if (tableSet(&instance->fields, name, peek(0))) {
+        ObjClass* loxClass = instance->loxClass;
+        if (loxClass->instanceCount <= SLACK_TRACKING_INSTANCES && instance->fields.count > loxClass->fieldCount) {
+            loxClass->fieldCount = instance->fields.count;
+        }
+    }
+    Value value = pop();
+    setTopValue(value);
+    return true;
+}
+
+/// @brief Pushes a closure over a function, capturing the upvalues described by the operands at the frame's instruction
+/// pointer and moving it past them.
+static void makeClosure(CallFrame* frame, ObjFunction* function) {
+    ObjClosure* closure = newClosure(function);
+    push(OBJ_VAL(closure));
+
+    for (int i = 0; i < closure->upvalueCount; ++i) {
+        uint8_t isLocal = *frame->ip++;
+        uint16_t index = (uint16_t)((frame->ip[0] << 8) | frame->ip[1]);
+        frame->ip += 2;
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        }
+        else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
+
+/// @brief Adds or subtracts the small integer operand of OP_ADD_INT or OP_SUBTRACT_INT to the value on top of the stack,
+/// like OP_ADD or OP_SUBTRACT would with the integer pushed.
+/// @returns Whether the value is a number. Reports the runtime error of the plain instruction if it isn't.
+static inline bool immediateArithmetic(uint8_t instruction, int32_t operand) {
+    if (IS_INT(peek(0))) {
+        int64_t a = AS_INT(peek(0));
+        int64_t result = instruction == OP_ADD_INT ? a + operand : a - operand;
+        if (result >= INT32_MIN && result <= INT32_MAX) {
+            setTopValue(INT_VAL((int32_t)result));
+            return true;
+        }
+    }
+    if (!IS_NUMBER(peek(0))) {
+        runtimeError(instruction == OP_ADD_INT ? "Operands must be two numbers or strings." : "Operands must be numbers.");
+        return false;
+    }
+    double a = AS_NUMBER(peek(0));
+    setTopValue(NUMBER_VAL(instruction == OP_ADD_INT ? a + operand : a - operand));
+    return true;
+}
+
 /// @brief Helper method to print the VM's current value stack.
 void printStack() {
     printf("          ");
@@ -296,6 +1094,19 @@ static InterpretResult run() {
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#ifdef GC_COMPACTION
+// Objects may only move where no C local holds a raw pointer into the heap.
+#define SAFEPOINT()               \
+    do {                          \
+        if (vm.compactionPending) { \
+            compactHeap();        \
+        }                         \
+    } while (false)
+#else
+#define SAFEPOINT() \
+    do {            \
+    } while (false)
+#endif
 
     while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
@@ -304,10 +1115,71 @@ static InterpretResult run() {
 #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
+            case OP_WIDE: {
+                // The same as the instruction after the prefix, with a two-byte index.
+                uint8_t wideInstruction = READ_BYTE();
+                uint16_t index = READ_SHORT();
+                Value* constants = frame->closure->function->chunk.constants.values;
+                switch (wideInstruction) {
+                    case OP_CONSTANT:
+                        push(constants[index]);
+                        break;
+                    case OP_DEFINE_GLOBAL:
+                        tableSet(&vm.globals, AS_STRING(constants[index]), peek(0));
+                        pop();
+                        break;
+                    case OP_GET_LOCAL:
+                        push(frame->slots[index]);
+                        break;
+                    case OP_SET_LOCAL:
+                        frame->slots[index] = peek(0);
+                        break;
+                    case OP_GET_UPVALUE:
+                        push(*frame->closure->upvalues[index]->location);
+                        break;
+                    case OP_SET_UPVALUE:
+                        *frame->closure->upvalues[index]->location = peek(0);
+                        break;
+                    case OP_GET_GLOBAL:
+                        if (!getGlobal(AS_STRING(constants[index]))) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        break;
+                    case OP_SET_GLOBAL:
+                        if (!setGlobal(AS_STRING(constants[index]))) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        break;
+                    case OP_GET_PROPERTY:
+                        if (!getProperty(AS_STRING(constants[index]))) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        break;
+                    case OP_SET_PROPERTY:
+                        if (!setProperty(AS_STRING(constants[index]))) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        break;
+                    case OP_CLOSURE:
+                        makeClosure(frame, AS_FUNCTION(constants[index]));
+                        break;
+                    case OP_CLASS:
+                        push(OBJ_VAL(newClass(AS_STRING(constants[index]))));
+                        break;
+                    default:
+                        // The compiler only emits the prefix before the instructions above.
+                        runtimeError("Invalid wide instruction %d.", wideInstruction);
+                        return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
             case OP_CONSTANT:
                 Value constant = READ_CONSTANT();
                 push(constant);
                 break;
+            case OP_INT:
+                push(INT_VAL((int16_t)READ_SHORT()));
+                break;
             case OP_NIL:
                 push(NIL_VAL);
                 break;
@@ -336,25 +1208,16 @@ static InterpretResult run() {
                 frame->slots[slot] = peek(0);
                 break;
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined global variable '%s'.", name->chars);
+            case OP_GET_GLOBAL:
+                if (!getGlobal(READ_STRING())) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
                 break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined global variable '%s'.", name->chars);
+            case OP_SET_GLOBAL:
+                if (!setGlobal(READ_STRING())) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
-            }
             case OP_GET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
                 push(*frame->closure->upvalues[slot]->location);
@@ -365,64 +1228,113 @@ static InterpretResult run() {
                 *frame->closure->upvalues[slot]->location = peek(0);
                 break;
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
+            case OP_GET_PROPERTY:
+                if (!getProperty(READ_STRING())) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    // Pop instance
-                    pop();
-                    // Push value
-                    push(value);
-                    break;
+                break;
+            case OP_SET_PROPERTY:
+                if (!setProperty(READ_STRING())) {
+                    return INTERPRET_RUNTIME_ERROR;
                 }
-
-                if (!bindMethod(instance->loxClass, name)) {
+                break;
+            case OP_GET_SUPER: {
+                int selector = READ_SHORT();
+                ObjClass* superclass = AS_CLASS(pop());
+                if (!bindMethod(superclass, selector)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
+            case OP_INDEX_GET: {
+                Value value;
+                if (IS_LIST(peek(1))) {
+                    ObjList* list = AS_LIST(peek(1));
+                    int index;
+                    if (!checkIndex(peek(0), list->count, &index)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    value = list->items[index];
+                }
+                else if (IS_MAP(peek(1))) {
+                    if (!mapGet(&AS_MAP(peek(1))->map, peek(0), &value)) {
+                        runtimeError("Key not found.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+                else if (IS_FLOAT64_ARRAY(peek(1))) {
+                    ObjFloat64Array* array = AS_FLOAT64_ARRAY(peek(1));
+                    int index;
+                    if (!checkIndex(peek(0), array->length, &index)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    value = NUMBER_VAL(array->data[index]);
+                }
+                else {
+                    runtimeError("Only lists, maps and arrays can be indexed.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
                 pop();
-                push(value);
+                setTopValue(value);
                 break;
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name)) {
+            case OP_INDEX_SET: {
+                if (IS_LIST(peek(2))) {
+                    ObjList* list = AS_LIST(peek(2));
+                    int index;
+                    if (!checkIndex(peek(1), list->count, &index)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    list->items[index] = peek(0);
+                }
+                else if (IS_MAP(peek(2))) {
+                    if (!checkMapKey(peek(1))) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    mapSet(&AS_MAP(peek(2))->map, peek(1), peek(0));
+                }
+                else if (IS_FLOAT64_ARRAY(peek(2))) {
+                    ObjFloat64Array* array = AS_FLOAT64_ARRAY(peek(2));
+                    int index;
+                    if (!checkIndex(peek(1), array->length, &index)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    if (!IS_NUMBER(peek(0))) {
+                        runtimeError("Float64Array elements must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    array->data[index] = AS_NUMBER(peek(0));
+                }
+                else {
+                    runtimeError("Only lists, maps and arrays can be indexed.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                Value value = pop();
+                pop();
+                setTopValue(value);
                 break;
             }
-            case OP_EQUAL:
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+            case OP_EQUAL: {
+                // Comparing ropes flattens them, so the operands stay on the stack until then.
+                bool equal = valuesEqual(peek(1), peek(0));
+                pop();
+                setTopValue(BOOL_VAL(equal));
                 break;
+            }
             case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                COMPARISON_OP(>);
                 break;
             case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
+                COMPARISON_OP(<);
                 break;
             case OP_ADD:
-                if (CHECK_TOP_TWO(IS_STRING)) {
-                    concatenate();
+                if (intArithmetic(OP_ADD)) {
+                    break;
+                }
+                if (CHECK_TOP_TWO(IS_STRING_OR_ROPE)) {
+                    if (!concatenate()) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
                 }
                 else if (CHECK_TOP_TWO(IS_NUMBER)) {
                     BINARY_OP(NUMBER_VAL, +);
@@ -433,14 +1345,24 @@ static InterpretResult run() {
                 }
                 break;
             case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
+                if (!intArithmetic(OP_SUBTRACT)) {
+                    BINARY_OP(NUMBER_VAL, -);
+                }
                 break;
             case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
+                if (!intArithmetic(OP_MULTIPLY)) {
+                    BINARY_OP(NUMBER_VAL, *);
+                }
                 break;
             case OP_DIVIDE:
                 BINARY_OP(NUMBER_VAL, /);
                 break;
+            case OP_ADD_INT:
+            case OP_SUBTRACT_INT:
+                if (!immediateArithmetic(instruction, (int16_t)READ_SHORT())) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
             case OP_NOT:
                 setTopValue(BOOL_VAL(isFalsey(peek(0))));
                 break;
@@ -449,9 +1371,18 @@ static InterpretResult run() {
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                setTopValue(NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1])));
+                // Negating 0 gives -0, and negating INT32_MIN overflows; both need a double.
+                if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0 && AS_INT(peek(0)) != INT32_MIN) {
+                    setTopValue(INT_VAL(-AS_INT(peek(0))));
+                }
+                else {
+                    setTopValue(NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1])));
+                }
                 break;
             case OP_PRINT:
+                if (IS_ROPE(peek(0))) {
+                    flattenRope(AS_ROPE(peek(0)));
+                }
                 printValue(pop());
                 printf("\n");
                 break;
@@ -460,16 +1391,148 @@ static InterpretResult run() {
                 frame->ip += offset;
                 break;
             }
-            case OP_JUMP_IF_FALSE: {
+            case OP_JUMP_IF_FALSE_OR_POP: {
                 uint16_t offset = READ_SHORT();
                 if (isFalsey(peek(0))) {
                     frame->ip += offset;
                 }
+                else {
+                    pop();
+                }
+                break;
+            }
+            case OP_JUMP_IF_TRUE_OR_POP: {
+                uint16_t offset = READ_SHORT();
+                if (!isFalsey(peek(0))) {
+                    frame->ip += offset;
+                }
+                else {
+                    pop();
+                }
+                break;
+            }
+            case OP_POP_JUMP_IF_FALSE: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(pop())) {
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OP_POP_JUMP_IF_TRUE: {
+                uint16_t offset = READ_SHORT();
+                if (!isFalsey(pop())) {
+                    frame->ip += offset;
+                }
                 break;
             }
+            case OP_JUMP_IF_LESS:
+                BRANCH_IF_COMPARISON(<, true, false);
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+                BRANCH_IF_COMPARISON(<, false, false);
+                break;
+            case OP_JUMP_IF_GREATER:
+                BRANCH_IF_COMPARISON(>, true, false);
+                break;
+            case OP_JUMP_IF_NOT_GREATER:
+                BRANCH_IF_COMPARISON(>, false, false);
+                break;
+            case OP_JUMP_IF_EQUAL:
+                BRANCH_IF_EQUAL(true, false);
+                break;
+            case OP_JUMP_IF_NOT_EQUAL:
+                BRANCH_IF_EQUAL(false, false);
+                break;
+            case OP_JUMP_IF_NIL:
+                BRANCH_IF_NIL(true, false);
+                break;
+            case OP_JUMP_IF_NOT_NIL:
+                BRANCH_IF_NIL(false, false);
+                break;
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
+                SAFEPOINT();
+                break;
+            }
+            case OP_POP_LOOP_IF_FALSE: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(pop())) {
+                    frame->ip -= offset;
+                    SAFEPOINT();
+                }
+                break;
+            }
+            case OP_POP_LOOP_IF_TRUE: {
+                uint16_t offset = READ_SHORT();
+                if (!isFalsey(pop())) {
+                    frame->ip -= offset;
+                    SAFEPOINT();
+                }
+                break;
+            }
+            case OP_LOOP_IF_LESS:
+                BRANCH_IF_COMPARISON(<, true, true);
+                break;
+            case OP_LOOP_IF_NOT_LESS:
+                BRANCH_IF_COMPARISON(<, false, true);
+                break;
+            case OP_LOOP_IF_GREATER:
+                BRANCH_IF_COMPARISON(>, true, true);
+                break;
+            case OP_LOOP_IF_NOT_GREATER:
+                BRANCH_IF_COMPARISON(>, false, true);
+                break;
+            case OP_LOOP_IF_EQUAL:
+                BRANCH_IF_EQUAL(true, true);
+                break;
+            case OP_LOOP_IF_NOT_EQUAL:
+                BRANCH_IF_EQUAL(false, true);
+                break;
+            case OP_LOOP_IF_NIL:
+                BRANCH_IF_NIL(true, true);
+                break;
+            case OP_LOOP_IF_NOT_NIL:
+                BRANCH_IF_NIL(false, true);
+                break;
+            case OP_FOR_RANGE_ENTER: {
+                Value* counter = &frame->slots[READ_SHORT()];
+                uint16_t offset = READ_SHORT();
+                if (!enterRange(counter)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // The loop variable.
+                push(counter[0]);
+                bool empty = IS_INT(counter[0]) ? AS_INT(counter[0]) >= AS_INT(counter[1])
+                                                : !(AS_NUMBER(counter[0]) < AS_NUMBER(counter[1]));
+                if (empty) {
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OP_FOR_RANGE: {
+                // The counter is followed by the end and the loop variable, and OP_FOR_RANGE_ENTER made both bounds the
+                // same kind of number.
+                Value* counter = &frame->slots[READ_SHORT()];
+                uint16_t offset = READ_SHORT();
+                if (IS_INT(counter[0])) {
+                    // The counter is below the end, so this can't overflow.
+                    int32_t next = AS_INT(counter[0]) + 1;
+                    if (next >= AS_INT(counter[1])) {
+                        break;
+                    }
+                    counter[0] = INT_VAL(next);
+                }
+                else {
+                    double next = AS_NUMBER(counter[0]) + 1;
+                    if (!(next < AS_NUMBER(counter[1]))) {
+                        break;
+                    }
+                    counter[0] = NUMBER_VAL(next);
+                }
+                counter[2] = counter[0];
+                frame->ip -= offset;
+                SAFEPOINT();
                 break;
             }
             case OP_CALL: {
@@ -478,48 +1541,38 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                SAFEPOINT();
                 break;
             }
             case OP_INVOKE: {
-                ObjString* method = READ_STRING();
+                int selector = READ_SHORT();
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                if (!invoke(selector, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
             case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
+                int selector = READ_SHORT();
                 int argCount = READ_BYTE();
                 ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
+                if (!invokeFromClass(superclass, selector, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-
-                for (int i = 0; i < closure->upvalueCount; ++i) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    }
-                    else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
+            case OP_CLOSURE:
+                makeClosure(frame, AS_FUNCTION(READ_CONSTANT()));
                 break;
-            }
             case OP_CLOSE_UPVALUE:
                 closeUpvalues(vm.stackTop - 1);
                 pop();
                 break;
+            case OP_RETURN_NIL:
+                push(NIL_VAL);
+                // Fall through
             case OP_RETURN: {
                 Value returnValue = pop();
                 closeUpvalues(frame->slots);
@@ -543,14 +1596,60 @@ static InterpretResult run() {
                     runtimeError("Superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                // The subclass has no methods yet, so it starts out with a copy of the superclass's.
                 ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                int methodCount = AS_CLASS(superclass)->methodCount;
+                if (methodCount > 0) {
+                    ObjClosure** methods = ALLOCATE(ObjClosure*, methodCount);
+                    memcpy(methods, AS_CLASS(superclass)->methods, sizeof(ObjClosure*) * methodCount);
+                    subclass->methods = methods;
+                    subclass->methodCount = methodCount;
+                }
+                tableAddAll(&AS_CLASS(superclass)->sparseMethods, &subclass->sparseMethods);
+                subclass->initializer = AS_CLASS(superclass)->initializer;
                 pop();
                 break;
             }
             case OP_METHOD:
-                defineMethod(READ_STRING());
+                defineMethod(READ_SHORT());
+                break;
+            case OP_BUILD_LIST: {
+                int count = READ_BYTE();
+                ObjList* list = newList(vm.stackTop - count, count);
+                vm.stackTop -= count;
+                push(OBJ_VAL(list));
+                break;
+            }
+            case OP_EXTEND_LIST: {
+                // The elements stay on the stack above the list until they have been copied.
+                int count = READ_BYTE();
+                listAppendAll(AS_LIST(vm.stackTop[-count - 1]), vm.stackTop - count, count);
+                vm.stackTop -= count;
+                break;
+            }
+            case OP_BUILD_MAP: {
+                int count = READ_BYTE();
+                ObjMap* map = newMap();
+                push(OBJ_VAL(map));
+                // The pairs stay on the stack below the map until all of them have been added.
+                Value* pairs = vm.stackTop - 1 - 2 * count;
+                if (!addPairs(map, pairs, count)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stackTop = pairs;
+                push(OBJ_VAL(map));
+                break;
+            }
+            case OP_EXTEND_MAP: {
+                // The pairs stay on the stack above the map until all of them have been added.
+                int count = READ_BYTE();
+                Value* pairs = vm.stackTop - 2 * count;
+                if (!addPairs(AS_MAP(pairs[-1]), pairs, count)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stackTop = pairs;
                 break;
+            }
         }
     }
 }
@@ -559,9 +1658,21 @@ static InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef SAFEPOINT
 #undef BINARY_OP
+#undef COMPARISON_OP
+#undef TAKE_BRANCH
+#undef BRANCH_IF_COMPARISON
+#undef BRANCH_IF_EQUAL
+#undef BRANCH_IF_NIL
 
 InterpretResult interpret(const char* source) {
+    ObjString* string = newString((int)strlen(source));
+    memcpy(string->chars, source, string->length);
+    return interpretSource(string);
+}
+
+InterpretResult interpretSource(ObjString* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
@@ -571,9 +1682,21 @@ InterpretResult interpret(const char* source) {
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
-    call(closure, 0);
+    if (!call(closure, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    jmp_buf allocationFailure;
+    if (setjmp(allocationFailure) != 0) {
+        vm.allocationFailure = NULL;
+        runtimeError("Out of memory: heap limit of %zu bytes exceeded.", vm.gcPolicy.maxHeapSize);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.allocationFailure = &allocationFailure;
+    InterpretResult result = run();
+    vm.allocationFailure = NULL;
 
-    return run();
+    return result;
 }
 
 void push(Value value) {
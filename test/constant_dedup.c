@@ -0,0 +1,62 @@
+// Checks that the compiler adds each constant to a chunk once, so that code repeating a few values hundreds of times keeps
+// one-byte constant indexes, and that values that are equal but not identical, like 0 and -0, are kept apart.
+// Usage: constant_dedup
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/compiler.h"
+#include "../include/vm.h"
+
+#define REPETITIONS 300
+
+/// @brief Reports a failed check.
+/// @returns Whether the check held.
+static bool check(bool holds, const char* description) {
+    if (!holds) {
+        printf("Failed: %s.\n", description);
+    }
+    return holds;
+}
+
+int main() {
+    const char* statement = "s = \"a repeated string\"; s = 123456; s = 0.25; s = -0.25; s = s + 100000;";
+    size_t statementLength = strlen(statement);
+    size_t length = strlen("var s;") + REPETITIONS * statementLength;
+    char* text = malloc(length + 1);
+    strcpy(text, "var s;");
+    for (int i = 0; i < REPETITIONS; ++i) {
+        strcat(text, statement);
+    }
+
+    initVM();
+    ObjString* source = copyString(text, (int)length);
+    push(OBJ_VAL(source));
+    ObjFunction* function = compile(source);
+    if (function == NULL) {
+        return 1;
+    }
+    push(OBJ_VAL(function));
+
+    bool passed = true;
+    // The name s, the string, 123456, 0.25 and 100000. The negative literal is negated when it runs.
+    ValueArray* constants = &function->chunk.constants;
+    printf("%d constants for %d repetitions.\n", constants->count, REPETITIONS);
+    passed &= check(constants->count == 5, "each constant is added once");
+
+    // A value is only the same constant if it has the same representation.
+    passed &= check(!valuesIdentical(NUMBER_VAL(0.0), NUMBER_VAL(-0.0)), "0 and -0 are different constants");
+    passed &= check(valuesIdentical(NUMBER_VAL(0.25), NUMBER_VAL(0.25)), "0.25 is the same constant as itself");
+#ifdef NAN_BOXING
+    // Ints are tagged, so an int constant and a double constant with the same value take different paths in arithmetic.
+    passed &= check(!valuesIdentical(INT_VAL(1), NUMBER_VAL(1.0)), "an int and a double are different constants");
+#endif
+
+    pop();
+    pop();
+    passed &= check(interpret(text) == INTERPRET_OK, "the script runs");
+    freeVM();
+    free(text);
+    return passed ? 0 : 1;
+}
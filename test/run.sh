@@ -0,0 +1,61 @@
+#!/bin/sh
+# Runs every test/*.lox script with the given interpreter and compares its output with the script's annotations:
+#   // expect: TEXT                 a line the script prints to stdout, in order
+#   // expect runtime error: TEXT   the first line printed to stderr; the script must exit with status 70
+#   // args: FLAGS                  extra interpreter flags placed before the script path. A script with several args
+#                                   lines is run once with each, and every run must match the annotations.
+# Usage: test/run.sh path/to/clox
+
+clox="$1"
+if [ -z "$clox" ]; then
+    echo "Usage: $0 path/to/clox" >&2
+    exit 64
+fi
+dir=$(dirname "$0")
+
+failed=0
+
+# Runs a script with the given flags and compares its output with its annotations.
+runTest() {
+    test="$1"
+    args="$2"
+    expected=$(sed -n 's|.*// expect: ||p' "$test")
+    expectedError=$(sed -n 's|.*// expect runtime error: ||p' "$test")
+    expectedStatus=0
+    if [ -n "$expectedError" ]; then
+        expectedStatus=70
+    fi
+
+    # shellcheck disable=SC2086
+    actual=$("$clox" $args "$test" 2>/tmp/clox_test_stderr.$$)
+    status=$?
+    actualError=$(head -n 1 /tmp/clox_test_stderr.$$)
+
+    if [ "$actual" != "$expected" ] || [ "$status" != "$expectedStatus" ] ||
+        { [ -n "$expectedError" ] && [ "$actualError" != "$expectedError" ]; }; then
+        echo "FAIL $test $args (exit $status, expected $expectedStatus)"
+        printf '%s\n' "$actual" > /tmp/clox_test_stdout.$$
+        printf '%s\n' "$expected" | diff /tmp/clox_test_stdout.$$ - | head -n 20
+        if [ -n "$actualError" ]; then
+            echo "stderr: $actualError"
+        fi
+        failed=1
+    fi
+}
+
+for test in "$dir"/*.lox; do
+    if grep -q '// args: ' "$test"; then
+        sed -n 's|.*// args: ||p' "$test" > /tmp/clox_test_args.$$
+        while IFS= read -r args; do
+            runTest "$test" "$args"
+        done < /tmp/clox_test_args.$$
+    else
+        runTest "$test" ""
+    fi
+done
+rm -f /tmp/clox_test_stderr.$$ /tmp/clox_test_stdout.$$ /tmp/clox_test_args.$$
+
+if [ "$failed" = 0 ]; then
+    echo "All tests passed."
+fi
+exit $failed